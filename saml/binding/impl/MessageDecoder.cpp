@@ -103,7 +103,7 @@ MessageDecoder::ArtifactResolver::~ArtifactResolver()
 
 bool MessageDecoder::ArtifactResolver::isSupported(const SSODescriptorType& ssoDescriptor) const
 {
-    EndpointManager<ArtifactResolutionService> mgr(ssoDescriptor.getArtifactResolutionServices());
+    EndpointManager<ArtifactResolutionService> mgr(ssoDescriptor, ssoDescriptor.getArtifactResolutionServices());
     if (ssoDescriptor.hasSupport(samlconstants::SAML20P_NS)) {
         auto_ptr_XMLCh binding(samlconstants::SAML20_BINDING_SOAP);
         return (mgr.getByBinding(binding.get()) != nullptr);
@@ -33,12 +33,13 @@
 #include <map>
 #include <vector>
 #include <string>
+#include <boost/unordered_map.hpp>
 
 namespace xmltooling {
     class XMLTOOL_API Credential;
     class XMLTOOL_API CredentialCriteria;
     class XMLTOOL_API KeyInfoResolver;
-    class XMLTOOL_API Mutex;
+    class XMLTOOL_API RWLock;
 };
 
 namespace opensaml {
@@ -67,6 +68,7 @@ namespace opensaml {
              * 
              * <ul>
              *  <li>&lt;KeyInfoResolver&gt; elements with a type attribute
+             *  <li>preloadCredentials attribute, to resolve the credentials of each role as entities are indexed
              * </ul>
              * 
              * XML namespaces are ignored in the processing of these elements.
@@ -91,6 +93,15 @@ namespace opensaml {
                 std::vector<const xmltooling::Credential*>& results, const xmltooling::CredentialCriteria* criteria=nullptr
                 ) const;
 
+            /**
+             * Supplies the ID of every entity the provider can return, for the benefit of
+             * providers that aggregate others. The provider must be locked.
+             *
+             * @param ids   array to populate
+             * @return  true iff the result covers every entity the provider can return
+             */
+            virtual bool getEntityIDs(std::vector<std::string>& ids) const;
+
         protected:
             /** Time of last update for reporting. */
             mutable time_t m_lastUpdate;
@@ -118,6 +129,14 @@ namespace opensaml {
              */
             virtual void indexGroup(EntitiesDescriptor* group, time_t& validUntil) const;
 
+            /**
+             * Removes an entity from the cache, along with any artifact source keys it was
+             * loaded under. The entity itself is not freed.
+             *
+             * @param site  entity definition
+             */
+            virtual void unindexEntity(const EntityDescriptor* site) const;
+
             /**
              * @deprecated
              * Loads an entity into the cache for faster lookup.
@@ -146,17 +165,31 @@ namespace opensaml {
             virtual void clearDescriptorIndex(bool freeSites=false);
 
         private:
-            typedef std::multimap<std::string,const EntityDescriptor*> sitemap_t;
-            typedef std::multimap<std::string,const EntitiesDescriptor*> groupmap_t;
+            // Hashed entity tables, each key mapping to its entries in insertion order.
+            typedef boost::unordered_map< std::string,std::vector<const EntityDescriptor*> > sitemap_t;
+            typedef boost::unordered_map< std::string,std::vector<const EntitiesDescriptor*> > groupmap_t;
             mutable sitemap_t m_sites;
             mutable sitemap_t m_sources;
             mutable groupmap_t m_groups;
 
+            // Reverse index from an entity to the keys it was stored under in the sources map.
+            typedef boost::unordered_map< const EntityDescriptor*,std::vector<std::string> > sourcekeymap_t;
+            mutable sourcekeymap_t m_sourceKeys;
+            void indexSource(const std::string& key, const EntityDescriptor* site) const;
+            void unindexSources(const EntityDescriptor* site) const;
+
             std::auto_ptr<xmltooling::KeyInfoResolver> m_resolverWrapper;
-            mutable std::auto_ptr<xmltooling::Mutex> m_credentialLock;
+
+            // Resolved credentials of each role, grouped by the role's entity so one entity can be dropped at a time.
+            bool m_preloadCredentials;
+            mutable std::auto_ptr<xmltooling::RWLock> m_credentialLock;
             typedef std::map< const RoleDescriptor*, std::vector<xmltooling::Credential*> > credmap_t;
-            mutable credmap_t m_credentialMap;
+            typedef std::map< const xmltooling::XMLObject*,credmap_t > entitycredmap_t;
+            mutable entitycredmap_t m_credentialMap;
             const credmap_t::mapped_type& resolveCredentials(const RoleDescriptor& role) const;
+            const credmap_t::mapped_type* findCredentials(const RoleDescriptor& role) const;
+            void clearCredentials(const xmltooling::XMLObject* entity) const;
+            void clearCredentials() const;
         };
 
 #if defined (_MSC_VER)
@@ -29,7 +29,9 @@
 
 #include <saml/saml2/metadata/MetadataProvider.h>
 
+#include <map>
 #include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 
 namespace opensaml {
     
@@ -64,6 +66,12 @@ namespace opensaml {
              *   <dt>entityAttributes</dt>
              *   <dd>true iff tags found in &lt;mdattr:EntityAttributes&gt;
              *      extensions should be included in the feed</dd>
+             *   <dt>compressFeed</dt>
+             *   <dd>true iff a compressed copy of the feed should be kept
+             *      alongside it, rather than compressing it on output</dd>
+             *   <dt>searchableFeed</dt>
+             *   <dd>true iff an index for searching the feed should be built
+             *      along with it</dd>
              *   <dt>&lt;DiscoveryFilter type="..." matcher="..." &gt;</dt>
              *   <dd>Zero or more filters of type "Whitelist" or "Blacklist" that
              *      affect which entities get exposed by the feed. The actual matching
@@ -82,6 +90,17 @@ namespace opensaml {
              */
             virtual void generateFeed();
 
+            /**
+             * Returns a key that identifies the content of an entity, so that its
+             * feed entry can be reused by the next call to generateFeed() if it
+             * turns up again unchanged.
+             * <p>The default returns an empty string, meaning entries are never reused.
+             *
+             * @param entity    an entity being added to the feed
+             * @return  a key derived from the entity's content, or an empty string
+             */
+            virtual std::string getFeedKey(const EntityDescriptor& entity) const;
+
         public:
             virtual ~DiscoverableMetadataProvider();
 
@@ -89,6 +108,9 @@ namespace opensaml {
              * Returns the ETag associated with the cached feed.
              * <p>The provider <strong>MUST</strong> be locked.
              *
+             * <p>The tag is derived from the feed's content, so it only changes
+             * when the feed does.
+             *
              * @return the ETag value for the current feed state
              */
             virtual std::string getCacheTag() const;
@@ -104,21 +126,126 @@ namespace opensaml {
              */
             virtual void outputFeed(std::ostream& os, bool& first, bool wrapArray=true) const;
 
+            /**
+             * Outputs the cached feed in gzip format.
+             * <p>The provider <strong>MUST</strong> be locked.
+             *
+             * <p>The feed is kept as deflate blocks that end on a byte boundary, so the
+             * feeds of several providers can be joined into one stream without
+             * recompressing them.
+             *
+             * @param os        stream to output compressed feed into
+             * @param first     on input, indicates if the feed is first in position,
+             *                  on output will be false if the feed was non-empty
+             * @param crc       running CRC-32 of the uncompressed output
+             * @param length    running length of the uncompressed output
+             * @param wrapArray true iff the gzip stream and feed array should be opened/closed by this provider
+             */
+            virtual void outputCompressedFeed(
+                std::ostream& os, bool& first, unsigned long& crc, unsigned long& length, bool wrapArray=true
+                ) const;
+
+            /**
+             * Searches the cached feed and returns the best matching entries.
+             * <p>The provider <strong>MUST</strong> be locked.
+             *
+             * <p>Each word of the query has to be the start of a word in an entry's entityID,
+             * display names, keywords, domain hints, or tags. Entries rank higher when the words
+             * are found in more prominent places, match whole words, or are in the preferred language.
+             *
+             * @param query     words to search for
+             * @param lang      preferred language, or nullptr
+             * @param results   array to add the best entries to, as pairs of rank and JSON text
+             * @param max       maximum number of entries to return
+             * @return  the total number of matching entries
+             */
+            virtual unsigned long searchFeed(
+                const char* query, const char* lang, std::vector< std::pair<unsigned int,std::string> >& results, unsigned long max
+                ) const;
+
+            /**
+             * Outputs a page of the entries matching a search, in the same format as the feed.
+             * <p>The provider <strong>MUST</strong> be locked.
+             *
+             * @param os        stream to output entries into
+             * @param query     words to search for
+             * @param lang      preferred language, or nullptr
+             * @param offset    number of matching entries to skip
+             * @param limit     maximum number of entries to output
+             * @return  the total number of matching entries
+             */
+            virtual unsigned long outputSearch(
+                std::ostream& os, const char* query, const char* lang, unsigned long offset, unsigned long limit
+                ) const;
+
         protected:
+            /**
+             * Opens a gzip stream and the feed array inside it.
+             *
+             * @param os        stream to output into
+             * @param crc       set to the CRC-32 of the output
+             * @param length    set to the length of the output
+             */
+            static void openCompressedFeed(std::ostream& os, unsigned long& crc, unsigned long& length);
+
+            /**
+             * Closes the feed array and the gzip stream around it.
+             *
+             * @param os        stream to output into
+             * @param crc       running CRC-32 of the output
+             * @param length    running length of the output
+             */
+            static void closeCompressedFeed(std::ostream& os, unsigned long& crc, unsigned long& length);
+
             /** Storage for feed. */
             std::string m_feed;
 
             /** ETag for feed. */
             mutable std::string m_feedTag;
 
+            /** Deflated copy of the feed, if kept. */
+            std::string m_compressedFeed;
+
+            /** CRC-32 of the feed. */
+            unsigned long m_feedCRC;
+
         private:
-            void discoEntity(std::string& s, const EntityDescriptor* entity, bool& first) const;
-            void discoGroup(std::string& s, const EntitiesDescriptor* group, bool& first) const;
+            // a word an entry can be found by, and how much it counts
+            struct SAML_DLLLOCAL searchterm_t {
+                searchterm_t(const std::string& word, unsigned int weight, const char* lang)
+                    : m_word(word), m_lang(lang ? lang : ""), m_weight(weight) {}
+                std::string m_word,m_lang;
+                unsigned int m_weight;
+            };
+
+            // a rendered feed entry, and the words it can be found by if the feed is searchable
+            struct SAML_DLLLOCAL feedentry_t {
+                std::string m_json;
+                std::vector<searchterm_t> m_terms;
+            };
+
+            // an occurrence of a word in one of the feed's entries
+            struct SAML_DLLLOCAL posting_t {
+                posting_t(unsigned int entry, const searchterm_t& term)
+                    : m_entry(entry), m_weight(term.m_weight), m_lang(term.m_lang) {}
+                unsigned int m_entry,m_weight;
+                std::string m_lang;
+            };
+
+            void discoEntity(std::string& s, const EntityDescriptor* entity, bool& first);
+            void renderEntity(feedentry_t& entry, const EntityDescriptor& entity, time_t now) const;
+            void collectTerms(std::vector<searchterm_t>& terms, const EntityDescriptor& entity, time_t now) const;
+            void discoGroup(std::string& s, const EntitiesDescriptor* group, bool& first);
             void discoEntityAttributes(std::string& s, const EntityAttributes& ea, bool& first) const;
             void discoAttributes(std::string& s, const std::vector<saml2::Attribute*>& attrs, bool& first) const;
 
-            bool m_legacyOrgNames, m_entityAttributes;
+            bool m_legacyOrgNames, m_entityAttributes, m_compressFeed, m_searchableFeed;
             std::vector< std::pair< bool, boost::shared_ptr<EntityMatcher> > > m_discoFilters;
+            // rendered entries by content key, from the current and previous feed
+            boost::unordered_map<std::string,feedentry_t> m_fragments,m_lastFragments;
+            // position and length of each entry in the feed, and the entries each word leads to
+            std::vector< std::pair<std::string::size_type,std::string::size_type> > m_feedEntries;
+            std::map< std::string,std::vector<posting_t> > m_searchIndex;
         };
 
 #if defined (_MSC_VER)
@@ -29,8 +29,14 @@
 
 #include <saml/saml2/metadata/AbstractMetadataProvider.h>
 
+#include <deque>
+#include <list>
+
 namespace xmltooling {
+    class XMLTOOL_API CondWait;
+    class XMLTOOL_API Mutex;
     class XMLTOOL_API RWLock;
+    class XMLTOOL_API Thread;
 };
 
 namespace opensaml {
@@ -38,6 +44,19 @@ namespace opensaml {
 
         /**
          * Simple implementation of a dynamic, caching MetadataProvider.
+         *
+         * <p>If refreshThreads is set, cached entities that reach the end of their
+         * caching interval are refreshed by a pool of background threads, and the
+         * cached copy is returned in the meantime. The threads start once something
+         * has been cached after init(). Subclasses have to opt in to them.
+         *
+         * <p>The maxEntities and maxNegativeEntries settings bound the number of cached
+         * entities and failed lookups, discarding the least recently used first.
+         *
+         * <p>If cacheDirectory is set, each resolved entity is saved there along with
+         * its next refresh time and validator, and the saved copy is used in place of
+         * a network lookup the first time the entity is needed, until it's due for refresh.
+         * After that, the saved validator lets the source answer that it hasn't changed.
          */
         class SAML_API DynamicMetadataProvider : public AbstractMetadataProvider
         {
@@ -55,8 +74,10 @@ namespace opensaml {
             xmltooling::Lockable* lock();
             void unlock();
             const char* getId() const;
+            void outputStatus(std::ostream& os) const;
             const xmltooling::XMLObject* getMetadata() const;
             std::pair<const EntityDescriptor*,const RoleDescriptor*> getEntityDescriptor(const Criteria& criteria) const;
+            bool getEntityIDs(std::vector<std::string>& ids) const;
 
         protected:
             /** Controls XML schema validation. */
@@ -70,13 +91,77 @@ namespace opensaml {
              */
             virtual EntityDescriptor* resolve(const Criteria& criteria) const;
 
+            /**
+             * Allows background refresh threads in a subclass. They call resolve(), so a subclass
+             * that calls this must also call shutdown() from its destructor. Otherwise a subclass
+             * ignores the refreshThreads setting and refreshes entities as they're looked up.
+             */
+            void allowRefreshThreads();
+
+            /**
+             * Stops any background refresh threads, after which no more are started.
+             */
+            void shutdown();
+
         private:
             std::string m_id;
             std::auto_ptr<xmltooling::RWLock> m_lock;
             double m_refreshDelayFactor;
             time_t m_minCacheDuration, m_maxCacheDuration;
-            typedef std::map<xmltooling::xstring,time_t> cachemap_t;
+
+            // Refresh time of each lookup, with its place in the recency list of cached entities or failed lookups,
+            // and whether it's been asked for since it was last refreshed.
+            typedef std::list<xmltooling::xstring> lrulist_t;
+            struct cacheentry_t {
+                time_t m_refresh;
+                bool m_found, m_accessed;
+                lrulist_t::iterator m_lru;
+            };
+            typedef std::map<xmltooling::xstring,cacheentry_t> cachemap_t;
             mutable cachemap_t m_cacheMap;
+            unsigned int m_maxEntities, m_maxNegativeEntries;
+            mutable lrulist_t m_entityLRU, m_negativeLRU;
+            mutable unsigned int m_entityCount, m_negativeCount;
+            void touch(cacheentry_t& entry) const;
+            void record(
+                const xmltooling::xstring& key, time_t refresh, bool found, std::vector<xmltooling::xstring>& evicted
+                ) const;
+            void evict(const xmltooling::xstring& key) const;
+            void evictAll(const std::vector<xmltooling::xstring>& evicted) const;
+            time_t getCacheInterval(const EntityDescriptor& entity, time_t now) const;
+
+            // Validators (ETag or Last-Modified) of cached entities, for conditional refresh requests,
+            // and those returned with resolved entities that haven't been accepted yet.
+            mutable std::map<xmltooling::xstring,std::string> m_cacheTags, m_pendingTags;
+
+            // Guards the cache map and the set of lookups in progress, whose completion is signalled.
+            mutable std::auto_ptr<xmltooling::Mutex> m_cacheLock;
+            mutable std::auto_ptr<xmltooling::CondWait> m_resolved;
+            mutable std::set<xmltooling::xstring> m_resolving;
+
+            bool cacheEntity(const Criteria& criteria, const std::string& name, const xmltooling::xstring& key, bool refresh) const;
+
+            // Background refresh, with the threads, queue and counters guarded by the cache lock.
+            unsigned int m_refreshThreads, m_maxRefreshQueue;
+            bool m_refreshAllowed, m_initialized;
+            mutable std::vector<xmltooling::Thread*> m_refreshers;
+            mutable std::auto_ptr<xmltooling::CondWait> m_refreshWait;
+            mutable std::deque<xmltooling::xstring> m_refreshQueue;
+            mutable unsigned int m_activeRefreshes;
+            mutable unsigned long m_failedRefreshes;
+            mutable time_t m_lastScan;
+            bool m_shutdown;
+            void startRefreshers() const;
+            bool queueRefresh(const xmltooling::xstring& key) const;
+            void scanForRefresh() const;
+            static void* refresh_fn(void*);
+
+            // Resolved entities saved across restarts, one file per entity named by the SHA-1 of its ID,
+            // as they came from the source so that they're filtered again when they're loaded.
+            std::string m_cacheDirectory;
+            std::string getCachePath(const std::string& name) const;
+            EntityDescriptor* loadEntity(const std::string& name, time_t& refresh, std::string& cacheTag) const;
+            void saveEntity(const std::string& xml, const std::string& name, time_t refresh, const std::string& cacheTag) const;
         };
 
     };
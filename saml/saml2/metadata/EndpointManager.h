@@ -27,14 +27,145 @@
 #ifndef __saml_epmgr_h__
 #define __saml_epmgr_h__
 
-#include <saml/base.h>
+#include <saml/saml2/metadata/Metadata.h>
 
+#include <algorithm>
+#include <map>
 #include <vector>
+#include <xmltooling/unicode.h>
 #include <xercesc/util/XMLString.hpp>
 
 namespace opensaml {
     namespace saml2md {
-        
+
+        /**
+         * Lookup tables for one of a role's endpoint collections, built when its entity is indexed
+         * so that selecting an endpoint doesn't have to scan the collection comparing bindings.
+         *
+         * <p>The endpoints are held untyped and are only handed back to managers of the type
+         * the table was built from. A table is only used while it holds the same endpoints as
+         * its collection, so endpoints added or removed later are found by scanning until the
+         * role's endpoints are indexed again.
+         */
+        class EndpointTable
+        {
+            struct binding_t {
+                binding_t(const xmltooling::xstring& binding, const void* endpoint)
+                    : m_binding(binding), m_first(endpoint), m_preferred(endpoint) {
+                }
+                xmltooling::xstring m_binding;
+                const void* m_first;
+                const void* m_preferred;
+            };
+
+            struct binding_less {
+                bool operator()(const binding_t& entry, const XMLCh* binding) const {
+                    return xercesc::XMLString::compareString(entry.m_binding.c_str(), binding) < 0;
+                }
+            };
+
+            std::vector<const void*> m_endpoints;
+            std::vector<binding_t> m_bindings;
+            std::map<int,const void*> m_indexes;
+            const void* m_default;
+
+            const binding_t* find(const XMLCh* binding) const {
+                std::vector<binding_t>::const_iterator i = std::lower_bound(m_bindings.begin(), m_bindings.end(), binding, binding_less());
+                return (i != m_bindings.end() && xercesc::XMLString::equals(i->m_binding.c_str(), binding)) ? &(*i) : nullptr;
+            }
+
+        public:
+            EndpointTable() : m_default(nullptr) {
+            }
+
+            /**
+             * Rebuilds the table from a collection of unindexed endpoints.
+             *
+             * @param endpoints the collection to build from
+             */
+            template <class _Tx> void build(const std::vector<_Tx*>& endpoints) {
+                m_endpoints.assign(endpoints.begin(), endpoints.end());
+                m_bindings.clear();
+                m_indexes.clear();
+                m_default = nullptr;
+                for (typename std::vector<_Tx*>::const_iterator i = endpoints.begin(); i != endpoints.end(); ++i) {
+                    xmltooling::xstring binding;
+                    if ((*i)->getBinding())
+                        binding = (*i)->getBinding();
+                    std::vector<binding_t>::iterator pos = std::lower_bound(m_bindings.begin(), m_bindings.end(), binding.c_str(), binding_less());
+                    if (pos == m_bindings.end() || pos->m_binding != binding)
+                        m_bindings.insert(pos, binding_t(binding, *i));
+                }
+            }
+
+            /**
+             * Rebuilds the table from a collection of indexed endpoints.
+             *
+             * @param endpoints the collection to build from
+             */
+            template <class _Tx> void buildIndexed(const std::vector<_Tx*>& endpoints) {
+                build(endpoints);
+                const _Tx* def = nullptr;
+                for (typename std::vector<_Tx*>::const_iterator i = endpoints.begin(); i != endpoints.end(); ++i) {
+                    std::pair<bool,int> index = (*i)->getIndex();
+                    if (index.first)
+                        m_indexes.insert(std::make_pair(index.second, static_cast<const void*>(*i)));
+                    if (!def && (*i)->isDefault())
+                        def = *i;
+                }
+                if (!def && !endpoints.empty())
+                    def = endpoints.front();
+                if (def) {
+                    m_default = def;
+                    binding_t* entry = const_cast<binding_t*>(find(def->getBinding()));
+                    if (entry)
+                        entry->m_preferred = def;
+                }
+            }
+
+            /**
+             * Returns true iff the table still holds exactly the endpoints in a collection.
+             *
+             * @param endpoints the collection the table was built from
+             * @return  true iff the table is current
+             */
+            template <class _Tx> bool matches(const std::vector<_Tx*>& endpoints) const {
+                return endpoints.size() == m_endpoints.size() && std::equal(endpoints.begin(), endpoints.end(), m_endpoints.begin());
+            }
+
+            /**
+             * Returns the default endpoint of an indexed collection.
+             *
+             * @return the default endpoint, or nullptr
+             */
+            const void* getDefault() const {
+                return m_default;
+            }
+
+            /**
+             * Returns an endpoint that supports a particular binding.
+             *
+             * @param binding       binding to locate
+             * @param favorDefault  true iff the default endpoint should win over earlier endpoints
+             * @return a supporting endpoint, or nullptr
+             */
+            const void* getByBinding(const XMLCh* binding, bool favorDefault=false) const {
+                const binding_t* entry = find(binding);
+                return entry ? (favorDefault ? entry->m_preferred : entry->m_first) : nullptr;
+            }
+
+            /**
+             * Returns an indexed endpoint.
+             *
+             * @param index index to locate
+             * @return matching endpoint, or nullptr
+             */
+            const void* getByIndex(int index) const {
+                std::map<int,const void*>::const_iterator i = m_indexes.find(index);
+                return (i != m_indexes.end()) ? i->second : nullptr;
+            }
+        };
+
         /**
          * Template for processing unindexed endpoint information.
          * 
@@ -46,6 +177,9 @@ namespace opensaml {
         protected:
             /** Reference to endpoint array. */
             const typename std::vector<_Tx*>& m_endpoints;
+
+            /** The role's lookup table for the endpoints, if it's current. */
+            const EndpointTable* m_table;
             
         public:
             /**
@@ -53,7 +187,19 @@ namespace opensaml {
              *
              * @param endpoints array of endpoints to manage
              */
-            EndpointManager(const typename std::vector<_Tx*>& endpoints) : m_endpoints(endpoints) {
+            EndpointManager(const typename std::vector<_Tx*>& endpoints) : m_endpoints(endpoints), m_table(nullptr) {
+            }
+
+            /**
+             * Constructor that uses the role's lookup table for the endpoints when it has one.
+             *
+             * @param role      role containing the endpoints
+             * @param endpoints array of endpoints to manage
+             */
+            EndpointManager(const RoleDescriptor& role, const typename std::vector<_Tx*>& endpoints)
+                    : m_endpoints(endpoints), m_table(role.getEndpointTable(&endpoints)) {
+                if (m_table && !m_table->matches(endpoints))
+                    m_table = nullptr;
             }
             
             /**
@@ -63,6 +209,8 @@ namespace opensaml {
              * @return a supporting endpoint, favoring the default, or nullptr
              */
             const _Tx* getByBinding(const XMLCh* binding) const {
+                if (m_table)
+                    return static_cast<const _Tx*>(m_table->getByBinding(binding));
                 for (typename std::vector<_Tx*>::const_iterator i = m_endpoints.begin(); i!=m_endpoints.end(); ++i) {
                     if (xercesc::XMLString::equals(binding,(*i)->getBinding()))
                         return *i;
@@ -79,7 +227,7 @@ namespace opensaml {
         template <class _Tx>
         class IndexedEndpointManager : public EndpointManager<_Tx>
         {
-            const _Tx* m_default;
+            mutable const _Tx* m_default;
             
         public:
             /**
@@ -89,6 +237,16 @@ namespace opensaml {
              */
             IndexedEndpointManager(const typename std::vector<_Tx*>& endpoints) : EndpointManager<_Tx>(endpoints), m_default(nullptr) {
             }
+
+            /**
+             * Constructor that uses the role's lookup table for the endpoints when it has one.
+             *
+             * @param role      role containing the endpoints
+             * @param endpoints array of endpoints to manage
+             */
+            IndexedEndpointManager(const RoleDescriptor& role, const typename std::vector<_Tx*>& endpoints)
+                : EndpointManager<_Tx>(role, endpoints), m_default(nullptr) {
+            }
             
             /**
              * Returns the default endpoint in the set.
@@ -98,6 +256,8 @@ namespace opensaml {
             const _Tx* getDefault() const {
                 if (m_default)
                     return m_default;
+                if (EndpointManager<_Tx>::m_table)
+                    return m_default=static_cast<const _Tx*>(EndpointManager<_Tx>::m_table->getDefault());
                 for (typename std::vector<_Tx*>::const_iterator i = EndpointManager<_Tx>::m_endpoints.begin(); i!=EndpointManager<_Tx>::m_endpoints.end(); ++i) {
                     if ((*i)->isDefault())
                         return m_default=*i;
@@ -112,6 +272,8 @@ namespace opensaml {
              * @return matching endpoint, or nullptr
              */
             const _Tx* getByIndex(unsigned short index) const {
+                if (EndpointManager<_Tx>::m_table)
+                    return static_cast<const _Tx*>(EndpointManager<_Tx>::m_table->getByIndex(index));
                 for (typename std::vector<_Tx*>::const_iterator i = EndpointManager<_Tx>::m_endpoints.begin(); i!=EndpointManager<_Tx>::m_endpoints.end(); ++i) {
                     std::pair<bool,int> comp = (*i)->getIndex();
                     if (comp.first && index == comp.second)
@@ -127,6 +289,8 @@ namespace opensaml {
              * @return a supporting endpoint, favoring the default, or nullptr
              */
             const _Tx* getByBinding(const XMLCh* binding) const {
+                if (EndpointManager<_Tx>::m_table)
+                    return static_cast<const _Tx*>(EndpointManager<_Tx>::m_table->getByBinding(binding, true));
                 if (getDefault() && xercesc::XMLString::equals(binding,m_default->getBinding()))
                     return m_default;
                 return EndpointManager<_Tx>::getByBinding(binding);
@@ -56,6 +56,7 @@ namespace opensaml {
 
         class SAML_API DigestMethod;
         class SAML_API SigningMethod;
+        class EndpointTable;
 
         /**
          * Base class for metadata objects that feature a cacheDuration attribute.
@@ -220,6 +221,10 @@ namespace opensaml {
             virtual std::pair<const SigningMethod*,const xmltooling::Credential*> getSigningMethod(
                 const xmltooling::CredentialResolver& resolver, xmltooling::CredentialCriteria& cc
                 ) const;
+            /** Rebuilds the lookup tables for the role's endpoint collections, as metadata providers do when indexing an entity. */
+            virtual void indexEndpoints();
+            /** Returns the lookup table last built for one of the role's endpoint collections, if any. */
+            virtual const EndpointTable* getEndpointTable(const void* endpoints) const;
         END_XMLOBJECT;
 
         BEGIN_XMLOBJECT2(SAML_API,RoleDescriptorType,RoleDescriptor,xmltooling::ElementExtensibleXMLObject,SAML 2.0 RoleDescriptor extension);
@@ -29,6 +29,7 @@
 
 #include <saml/base.h>
 
+#include <set>
 #include <vector>
 #include <iostream>
 #include <boost/ptr_container/ptr_vector.hpp>
@@ -260,6 +261,15 @@ namespace opensaml {
              */
             void doFilters(xmltooling::XMLObject& xmlObject) const;
 
+            /**
+             * Applies any installed filters to a metadata instance, other than those
+             * of the excluded types.
+             *
+             * @param xmlObject the metadata to be filtered
+             * @param excluded  types of the filters to skip
+             */
+            void doFilters(xmltooling::XMLObject& xmlObject, const std::set<std::string>& excluded) const;
+
         private:
             const MetadataFilterContext* m_filterContext;
             boost::ptr_vector<MetadataFilter> m_filters;
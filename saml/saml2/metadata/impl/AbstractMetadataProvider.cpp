@@ -53,11 +53,13 @@ using namespace boost;
 using namespace std;
 using opensaml::SAMLArtifact;
 
-static const XMLCh _KeyInfoResolver[] = UNICODE_LITERAL_15(K,e,y,I,n,f,o,R,e,s,o,l,v,e,r);
-static const XMLCh _type[] =            UNICODE_LITERAL_4(t,y,p,e);
+static const XMLCh _KeyInfoResolver[] =    UNICODE_LITERAL_15(K,e,y,I,n,f,o,R,e,s,o,l,v,e,r);
+static const XMLCh preloadCredentials[] =  UNICODE_LITERAL_18(p,r,e,l,o,a,d,C,r,e,d,e,n,t,i,a,l,s);
+static const XMLCh _type[] =               UNICODE_LITERAL_4(t,y,p,e);
 
 AbstractMetadataProvider::AbstractMetadataProvider(const DOMElement* e)
-    : ObservableMetadataProvider(e), m_lastUpdate(0),  m_resolver(nullptr), m_credentialLock(Mutex::create())
+    : ObservableMetadataProvider(e), m_lastUpdate(0),  m_resolver(nullptr),
+        m_preloadCredentials(XMLHelper::getAttrBool(e, false, preloadCredentials)), m_credentialLock(RWLock::create())
 {
     e = XMLHelper::getFirstChildElement(e, _KeyInfoResolver);
     if (e) {
@@ -74,8 +76,7 @@ AbstractMetadataProvider::AbstractMetadataProvider(const DOMElement* e)
 
 AbstractMetadataProvider::~AbstractMetadataProvider()
 {
-    for (credmap_t::iterator c = m_credentialMap.begin(); c!=m_credentialMap.end(); ++c)
-        for_each(c->second.begin(), c->second.end(), xmltooling::cleanup<Credential>());
+    clearCredentials();
 }
 
 void AbstractMetadataProvider::outputStatus(ostream& os) const
@@ -98,17 +99,45 @@ void AbstractMetadataProvider::outputStatus(ostream& os) const
 
 void AbstractMetadataProvider::emitChangeEvent() const
 {
-    for (credmap_t::iterator c = m_credentialMap.begin(); c!=m_credentialMap.end(); ++c)
-        for_each(c->second.begin(), c->second.end(), xmltooling::cleanup<Credential>());
-    m_credentialMap.clear();
+    {
+        m_credentialLock->wrlock();
+        SharedLock locker(m_credentialLock.get(), false);
+        if (m_preloadCredentials) {
+            // Keep what was preloaded for the entities that are indexed now.
+            set<const XMLObject*> live;
+            for (sitemap_t::const_iterator i = m_sites.begin(); i != m_sites.end(); ++i)
+                live.insert(i->second.begin(), i->second.end());
+            for (entitycredmap_t::iterator e = m_credentialMap.begin(); e != m_credentialMap.end();) {
+                if (live.count(e->first)) {
+                    ++e;
+                    continue;
+                }
+                for (credmap_t::iterator c = e->second.begin(); c != e->second.end(); ++c)
+                    for_each(c->second.begin(), c->second.end(), xmltooling::cleanup<Credential>());
+                m_credentialMap.erase(e++);
+            }
+        }
+        else {
+            clearCredentials();
+        }
+    }
     ObservableMetadataProvider::emitChangeEvent();
 }
 
 void AbstractMetadataProvider::emitChangeEvent(const EntityDescriptor& entity) const
 {
-    for (credmap_t::iterator c = m_credentialMap.begin(); c!=m_credentialMap.end(); ++c)
-        for_each(c->second.begin(), c->second.end(), xmltooling::cleanup<Credential>());
-    m_credentialMap.clear();
+    // Only the copies of this entity that are being replaced or removed have stale credentials.
+    auto_ptr_char id(entity.getEntityID());
+    {
+        m_credentialLock->wrlock();
+        SharedLock locker(m_credentialLock.get(), false);
+        clearCredentials(&entity);
+        sitemap_t::const_iterator sites = id.get() ? m_sites.find(id.get()) : m_sites.end();
+        if (sites != m_sites.end()) {
+            for (vector<const EntityDescriptor*>::const_iterator site = sites->second.begin(); site != sites->second.end(); ++site)
+                clearCredentials(*site);
+        }
+    }
     ObservableMetadataProvider::emitChangeEvent(entity);
 }
 
@@ -123,31 +152,38 @@ void AbstractMetadataProvider::indexEntity(EntityDescriptor* site, time_t& valid
     auto_ptr_char id(site->getEntityID());
     if (id.get()) {
         if (replace) {
-            // The data structure here needs work.
-            // We have to find all the sites stored against the replaced ID. Then we have to
-            // search for those sites in the entire set of sites tracked by the sources map and
-            // remove them from both places.
-            set<const EntityDescriptor*> existingSites;
-            pair<sitemap_t::iterator,sitemap_t::iterator> existingRange = m_sites.equal_range(id.get());
-            static pair<set<const EntityDescriptor*>::iterator,bool> (set<const EntityDescriptor*>::* ins)(const EntityDescriptor* const &) =
-                &set<const EntityDescriptor*>::insert;
-            for_each(
-                existingRange.first, existingRange.second,
-                lambda::bind(ins, boost::ref(existingSites), lambda::bind(&sitemap_t::value_type::second, _1))
-                );
-            m_sites.erase(existingRange.first, existingRange.second);
-            for (sitemap_t::iterator s = m_sources.begin(); s != m_sources.end();) {
-                if (existingSites.count(s->second) > 0) {
-                    sitemap_t::iterator temp = s;
-                    ++s;
-                    m_sources.erase(temp);
-                }
-                else {
-                    ++s;
-                }
+            // Drop all the sites stored against the replaced ID, along with
+            // the artifact source keys each of them was indexed under.
+            sitemap_t::iterator existing = m_sites.find(id.get());
+            if (existing != m_sites.end()) {
+                for_each(
+                    existing->second.begin(), existing->second.end(),
+                    lambda::bind(&AbstractMetadataProvider::unindexSources, this, _1)
+                    );
+                m_sites.erase(existing);
             }
         }
-        m_sites.insert(sitemap_t::value_type(id.get(),site));
+        m_sites[id.get()].push_back(site);
+    }
+
+    // Build the endpoint lookup tables for each role, so that requests never have to scan them.
+    const list<XMLObject*>& members = site->getOrderedChildren();
+    for (list<XMLObject*>::const_iterator member = members.begin(); member != members.end(); ++member) {
+        RoleDescriptor* role = dynamic_cast<RoleDescriptor*>(*member);
+        if (role)
+            role->indexEndpoints();
+    }
+
+    if (m_preloadCredentials) {
+        // Resolve up front so that requests never have to.
+        m_credentialLock->wrlock();
+        SharedLock locker(m_credentialLock.get(), false);
+        const list<XMLObject*>& children = site->getOrderedChildren();
+        for (list<XMLObject*>::const_iterator child = children.begin(); child != children.end(); ++child) {
+            const RoleDescriptor* role = dynamic_cast<const RoleDescriptor*>(*child);
+            if (role)
+                resolveCredentials(*role);
+        }
     }
     
     // Process each IdP role.
@@ -164,7 +200,7 @@ void AbstractMetadataProvider::indexEntity(EntityDescriptor* site, time_t& valid
                     if (sid) {
                         auto_ptr_char sourceid(sid->getID());
                         if (sourceid.get()) {
-                            m_sources.insert(sitemap_t::value_type(sourceid.get(),site));
+                            indexSource(sourceid.get(), site);
                             break;
                         }
                     }
@@ -172,23 +208,64 @@ void AbstractMetadataProvider::indexEntity(EntityDescriptor* site, time_t& valid
             }
             
             // Hash the ID.
-            m_sources.insert(sitemap_t::value_type(SecurityHelper::doHash("SHA1", id.get(), strlen(id.get())),site));
+            indexSource(SecurityHelper::doHash("SHA1", id.get(), strlen(id.get())), site);
                 
             // Load endpoints for type 0x0002 artifacts.
             const vector<ArtifactResolutionService*>& locs = const_cast<const IDPSSODescriptor*>(*i)->getArtifactResolutionServices();
             for (vector<ArtifactResolutionService*>::const_iterator loc = locs.begin(); loc != locs.end(); loc++) {
                 auto_ptr_char location((*loc)->getLocation());
                 if (location.get())
-                    m_sources.insert(sitemap_t::value_type(location.get(),site));
+                    indexSource(location.get(), site);
             }
         }
         
         // SAML 2.0?
         if ((*i)->hasSupport(samlconstants::SAML20P_NS)) {
             // Hash the ID.
-            m_sources.insert(sitemap_t::value_type(SecurityHelper::doHash("SHA1", id.get(), strlen(id.get())),site));
+            indexSource(SecurityHelper::doHash("SHA1", id.get(), strlen(id.get())), site);
+        }
+    }
+}
+
+void AbstractMetadataProvider::indexSource(const string& key, const EntityDescriptor* site) const
+{
+    // Roles supporting more than one protocol can contribute the same key more than once.
+    sitemap_t::mapped_type& sites = m_sources[key];
+    if (sites.empty() || sites.back() != site) {
+        sites.push_back(site);
+        m_sourceKeys[site].push_back(key);
+    }
+}
+
+void AbstractMetadataProvider::unindexSources(const EntityDescriptor* site) const
+{
+    sourcekeymap_t::iterator keys = m_sourceKeys.find(site);
+    if (keys == m_sourceKeys.end())
+        return;
+
+    for (vector<string>::const_iterator k = keys->second.begin(); k != keys->second.end(); ++k) {
+        sitemap_t::iterator sources = m_sources.find(*k);
+        if (sources != m_sources.end()) {
+            sources->second.erase(remove(sources->second.begin(), sources->second.end(), site), sources->second.end());
+            if (sources->second.empty())
+                m_sources.erase(sources);
+        }
+    }
+    m_sourceKeys.erase(keys);
+}
+
+void AbstractMetadataProvider::unindexEntity(const EntityDescriptor* site) const
+{
+    auto_ptr_char id(site->getEntityID());
+    if (id.get()) {
+        sitemap_t::iterator sites = m_sites.find(id.get());
+        if (sites != m_sites.end()) {
+            sites->second.erase(remove(sites->second.begin(), sites->second.end(), site), sites->second.end());
+            if (sites->second.empty())
+                m_sites.erase(sites);
         }
     }
+    unindexSources(site);
 }
 
 void AbstractMetadataProvider::indexGroup(EntitiesDescriptor* group, time_t& validUntil) const
@@ -201,7 +278,7 @@ void AbstractMetadataProvider::indexGroup(EntitiesDescriptor* group, time_t& val
 
     auto_ptr_char name(group->getName());
     if (name.get()) {
-        m_groups.insert(groupmap_t::value_type(name.get(),group));
+        m_groups[name.get()].push_back(group);
     }
     
     // Track the smallest validUntil amongst the children.
@@ -240,32 +317,45 @@ void AbstractMetadataProvider::index(EntitiesDescriptor* group, time_t validUnti
     indexGroup(group, validUntil);
 }
 
+bool AbstractMetadataProvider::getEntityIDs(vector<string>& ids) const
+{
+    ids.reserve(ids.size() + m_sites.size());
+    for (sitemap_t::const_iterator i = m_sites.begin(); i != m_sites.end(); ++i)
+        ids.push_back(i->first);
+    return true;
+}
+
 void AbstractMetadataProvider::clearDescriptorIndex(bool freeSites)
 {
-    if (freeSites)
-        for_each(m_sites.begin(), m_sites.end(), cleanup_const_pair<string,EntityDescriptor>());
+    if (freeSites) {
+        for (sitemap_t::iterator i = m_sites.begin(); i != m_sites.end(); ++i)
+            for_each(i->second.begin(), i->second.end(), xmltooling::cleanup<EntityDescriptor>());
+    }
     m_sites.clear();
     m_groups.clear();
     m_sources.clear();
+    m_sourceKeys.clear();
 }
 
 const EntitiesDescriptor* AbstractMetadataProvider::getEntitiesDescriptor(const char* name, bool strict) const
 {
-    pair<groupmap_t::const_iterator,groupmap_t::const_iterator> range=const_cast<const groupmap_t&>(m_groups).equal_range(name);
+    groupmap_t::const_iterator range = m_groups.find(name);
+    if (range == m_groups.end())
+        return nullptr;
 
     time_t now=time(nullptr);
-    for (groupmap_t::const_iterator i=range.first; i!=range.second; i++)
-        if (now < i->second->getValidUntilEpoch())
-            return i->second;
+    for (groupmap_t::mapped_type::const_iterator i=range->second.begin(); i!=range->second.end(); i++)
+        if (now < (*i)->getValidUntilEpoch())
+            return *i;
     
-    if (range.first != range.second) {
+    if (!range->second.empty()) {
         Category& log = Category::getInstance(SAML_LOGCAT".MetadataProvider");
         if (strict) {
-            log.warn("ignored expired metadata group (%s)", range.first->first.c_str());
+            log.warn("ignored expired metadata group (%s)", range->first.c_str());
         }
         else {
-            log.info("no valid metadata found, returning expired metadata group (%s)", range.first->first.c_str());
-            return range.first->second;
+            log.info("no valid metadata found, returning expired metadata group (%s)", range->first.c_str());
+            return range->second.front();
         }
     }
 
@@ -274,38 +364,47 @@ const EntitiesDescriptor* AbstractMetadataProvider::getEntitiesDescriptor(const
 
 pair<const EntityDescriptor*,const RoleDescriptor*> AbstractMetadataProvider::getEntityDescriptor(const Criteria& criteria) const
 {
-    pair<sitemap_t::const_iterator,sitemap_t::const_iterator> range;
-    if (criteria.entityID_ascii)
-        range = const_cast<const sitemap_t&>(m_sites).equal_range(criteria.entityID_ascii);
-    else if (criteria.entityID_unicode) {
-        auto_ptr_char id(criteria.entityID_unicode);
-        range = const_cast<const sitemap_t&>(m_sites).equal_range(id.get());
-    }
-    else if (criteria.artifact)
-        range = const_cast<const sitemap_t&>(m_sources).equal_range(criteria.artifact->getSource());
-    else
-        return pair<const EntityDescriptor*,const RoleDescriptor*>(nullptr,nullptr);
-    
     pair<const EntityDescriptor*,const RoleDescriptor*> result;
     result.first = nullptr;
     result.second = nullptr;
+
+    sitemap_t::const_iterator range;
+    if (criteria.entityID_ascii) {
+        range = m_sites.find(criteria.entityID_ascii);
+        if (range == m_sites.end())
+            return result;
+    }
+    else if (criteria.entityID_unicode) {
+        auto_ptr_char id(criteria.entityID_unicode);
+        range = m_sites.find(id.get());
+        if (range == m_sites.end())
+            return result;
+    }
+    else if (criteria.artifact) {
+        range = m_sources.find(criteria.artifact->getSource());
+        if (range == m_sources.end())
+            return result;
+    }
+    else {
+        return result;
+    }
     
     time_t now=time(nullptr);
-    for (sitemap_t::const_iterator i=range.first; i!=range.second; i++) {
-        if (now < i->second->getValidUntilEpoch()) {
-            result.first = i->second;
+    for (sitemap_t::mapped_type::const_iterator i=range->second.begin(); i!=range->second.end(); i++) {
+        if (now < (*i)->getValidUntilEpoch()) {
+            result.first = *i;
             break;
         }
     }
     
-    if (!result.first && range.first!=range.second) {
+    if (!result.first && !range->second.empty()) {
         Category& log = Category::getInstance(SAML_LOGCAT".MetadataProvider");
         if (criteria.validOnly) {
-            log.warn("ignored expired metadata instance for (%s)", range.first->first.c_str());
+            log.warn("ignored expired metadata instance for (%s)", range->first.c_str());
         }
         else {
-            log.info("no valid metadata found, returning expired instance for (%s)", range.first->first.c_str());
-            result.first = range.first->second;
+            log.info("no valid metadata found, returning expired instance for (%s)", range->first.c_str());
+            result.first = range->second.front();
         }
     }
 
@@ -324,13 +423,19 @@ const Credential* AbstractMetadataProvider::resolve(const CredentialCriteria* cr
     if (!metacrit)
         throw MetadataException("Cannot resolve credentials without a MetadataCredentialCriteria object.");
 
-    Lock lock(m_credentialLock);
-    const credmap_t::mapped_type& creds = resolveCredentials(metacrit->getRole());
+    // Most lookups hit the cache and only need a shared lock.
+    SharedLock locker(m_credentialLock.get());
+    const credmap_t::mapped_type* creds = findCredentials(metacrit->getRole());
+    if (!creds) {
+        m_credentialLock->unlock();
+        m_credentialLock->wrlock();
+        creds = &resolveCredentials(metacrit->getRole());
+    }
 
-    for (credmap_t::mapped_type::const_iterator c = creds.begin(); c!=creds.end(); ++c)
-	if (metacrit->matches(*(*c)))
-	return *c;
-return nullptr;
+    for (credmap_t::mapped_type::const_iterator c = creds->begin(); c!=creds->end(); ++c)
+        if (metacrit->matches(*(*c)))
+            return *c;
+    return nullptr;
 }
 
 vector<const Credential*>::size_type AbstractMetadataProvider::resolve(
@@ -341,24 +446,43 @@ vector<const Credential*>::size_type AbstractMetadataProvider::resolve(
     if (!metacrit)
         throw MetadataException("Cannot resolve credentials without a MetadataCredentialCriteria object.");
 
-    Lock lock(m_credentialLock);
-    const credmap_t::mapped_type& creds = resolveCredentials(metacrit->getRole());
+    // Most lookups hit the cache and only need a shared lock.
+    SharedLock locker(m_credentialLock.get());
+    const credmap_t::mapped_type* creds = findCredentials(metacrit->getRole());
+    if (!creds) {
+        m_credentialLock->unlock();
+        m_credentialLock->wrlock();
+        creds = &resolveCredentials(metacrit->getRole());
+    }
 
-   for (credmap_t::mapped_type::const_iterator c = creds.begin(); c!=creds.end(); ++c)
-	if (metacrit->matches(*(*c)))
-	    results.push_back(*c); 
+    for (credmap_t::mapped_type::const_iterator c = creds->begin(); c!=creds->end(); ++c)
+        if (metacrit->matches(*(*c)))
+            results.push_back(*c);
     return results.size();
 }
 
+const AbstractMetadataProvider::credmap_t::mapped_type* AbstractMetadataProvider::findCredentials(const RoleDescriptor& role) const
+{
+    // Called with the credential lock held for reading or writing.
+    entitycredmap_t::const_iterator e = m_credentialMap.find(role.getParent());
+    if (e != m_credentialMap.end()) {
+        credmap_t::const_iterator i = e->second.find(&role);
+        if (i != e->second.end())
+            return &(i->second);
+    }
+    return nullptr;
+}
+
 const AbstractMetadataProvider::credmap_t::mapped_type& AbstractMetadataProvider::resolveCredentials(const RoleDescriptor& role) const
 {
-    credmap_t::const_iterator i = m_credentialMap.find(&role);
-    if (i != m_credentialMap.end())
-        return i->second;
+    // Called with the credential lock held for writing, so another thread may have gotten here first.
+    const credmap_t::mapped_type* cached = findCredentials(role);
+    if (cached)
+        return *cached;
 
     const KeyInfoResolver* resolver = m_resolver ? m_resolver : XMLToolingConfig::getConfig().getKeyInfoResolver();
     const vector<KeyDescriptor*>& keys = role.getKeyDescriptors();
-    AbstractMetadataProvider::credmap_t::mapped_type& resolved = m_credentialMap[&role];
+    AbstractMetadataProvider::credmap_t::mapped_type& resolved = m_credentialMap[role.getParent()][&role];
     for (indirect_iterator<vector<KeyDescriptor*>::const_iterator> k = make_indirect_iterator(keys.begin());
             k != make_indirect_iterator(keys.end()); ++k) {
         if (k->getKeyInfo()) {
@@ -373,3 +497,21 @@ const AbstractMetadataProvider::credmap_t::mapped_type& AbstractMetadataProvider
     }
     return resolved;
 }
+
+void AbstractMetadataProvider::clearCredentials(const XMLObject* entity) const
+{
+    entitycredmap_t::iterator e = m_credentialMap.find(entity);
+    if (e != m_credentialMap.end()) {
+        for (credmap_t::iterator c = e->second.begin(); c != e->second.end(); ++c)
+            for_each(c->second.begin(), c->second.end(), xmltooling::cleanup<Credential>());
+        m_credentialMap.erase(e);
+    }
+}
+
+void AbstractMetadataProvider::clearCredentials() const
+{
+    for (entitycredmap_t::iterator e = m_credentialMap.begin(); e != m_credentialMap.end(); ++e)
+        for (credmap_t::iterator c = e->second.begin(); c != e->second.end(); ++c)
+            for_each(c->second.begin(), c->second.end(), xmltooling::cleanup<Credential>());
+    m_credentialMap.clear();
+}
@@ -30,6 +30,7 @@
 #include "saml2/metadata/MetadataFilter.h"
 
 #include <boost/scoped_ptr.hpp>
+#include <boost/unordered_set.hpp>
 #include <xmltooling/logging.h>
 
 using namespace opensaml::saml2md;
@@ -41,6 +42,10 @@ using namespace std;
 
 namespace opensaml {
     namespace saml2md {
+
+        // removes the flagged entities from a group (MetadataProvider.cpp)
+        SAML_DLLLOCAL void removeEntities(EntitiesDescriptor& group, const vector<bool>& removed);
+
         class SAML_DLLLOCAL BlacklistMetadataFilter : public MetadataFilter
         {
         public:
@@ -54,7 +59,7 @@ namespace opensaml {
             void filterGroup(EntitiesDescriptor*) const;
             bool included(const EntityDescriptor&) const;
 
-            set<xstring> m_entities;
+            boost::unordered_set<xstring> m_entities;
             scoped_ptr<EntityMatcher> m_matcher;
         }; 
 
@@ -108,20 +113,21 @@ void BlacklistMetadataFilter::doFilter(XMLObject& xmlObject) const
 
 void BlacklistMetadataFilter::filterGroup(EntitiesDescriptor* entities) const
 {
-    Category& log = Category::getInstance(SAML_LOGCAT".MetadataFilter."WHITELIST_METADATA_FILTER);
+    Category& log = Category::getInstance(SAML_LOGCAT".MetadataFilter."BLACKLIST_METADATA_FILTER);
 
-    VectorOf(EntityDescriptor) v = entities->getEntityDescriptors();
-    for (VectorOf(EntityDescriptor)::size_type i = 0; i < v.size(); ) {
+    // Decide on every entity first, so each one is matched once and removals can be batched.
+    const vector<EntityDescriptor*>& v = const_cast<const EntitiesDescriptor*>(entities)->getEntityDescriptors();
+    vector<bool> removed(v.size());
+    for (vector<EntityDescriptor*>::size_type i = 0; i < v.size(); ++i) {
         if (included(*v[i])) {
             auto_ptr_char id(v[i]->getEntityID());
             log.info("filtering out blacklisted entity (%s)", id.get());
-            v.erase(v.begin() + i);
-        }
-        else {
-            i++;
+            removed[i] = true;
         }
     }
 
+    removeEntities(*entities, removed);
+
     VectorOf(EntitiesDescriptor) w = entities->getEntitiesDescriptors();
     for (VectorOf(EntitiesDescriptor)::size_type j = 0; j < w.size(); ) {
         const XMLCh* name = w[j]->getName();
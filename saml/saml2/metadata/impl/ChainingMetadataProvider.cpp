@@ -28,16 +28,20 @@
 #include "exceptions.h"
 #include "saml/binding/SAMLArtifact.h"
 #include "saml2/metadata/Metadata.h"
+#include "saml2/metadata/AbstractMetadataProvider.h"
 #include "saml2/metadata/DiscoverableMetadataProvider.h"
 #include "saml2/metadata/ObservableMetadataProvider.h"
 #include "saml2/metadata/MetadataCredentialCriteria.h"
 
 #include <memory>
+#include <algorithm>
 #include <functional>
 #include <boost/bind.hpp>
+#include <boost/unordered_map.hpp>
 #include <boost/ptr_container/ptr_vector.hpp>
 #include <xercesc/util/XMLUniDefs.hpp>
 #include <xmltooling/logging.h>
+#include <xmltooling/security/SecurityHelper.h>
 #include <xmltooling/util/Threads.h>
 #include <xmltooling/util/XMLHelper.h>
 
@@ -55,6 +59,16 @@ namespace opensaml {
 
         // per-thread structure allocated to track locks and role->provider mappings
         struct SAML_DLLLOCAL tracker_t;
+
+        // work shared by the threads initializing the chain's providers
+        struct SAML_DLLLOCAL initializer_t {
+            initializer_t(ptr_vector<MetadataProvider>& providers, Category& log)
+                : m_providers(providers), m_log(log), m_lock(Mutex::create()), m_next(0) {}
+            ptr_vector<MetadataProvider>& m_providers;
+            Category& m_log;
+            auto_ptr<Mutex> m_lock;
+            ptr_vector<MetadataProvider>::size_type m_next;
+        };
         
         class SAML_DLLLOCAL ChainingMetadataProvider
             : public DiscoverableMetadataProvider, public ObservableMetadataProvider, public ObservableMetadataProvider::Observer {
@@ -78,8 +92,17 @@ namespace opensaml {
             vector<const Credential*>::size_type resolve(vector<const Credential*>&, const CredentialCriteria* criteria=nullptr) const;
 
             string getCacheTag() const {
-                Lock lock(m_trackerLock);
-                return m_feedTag;
+                // Derived from the members' tags, so it only changes when one of their feeds does.
+                string tags;
+                for (ptr_vector<MetadataProvider>::iterator m = m_providers.begin(); m != m_providers.end(); ++m) {
+                    DiscoverableMetadataProvider* d = dynamic_cast<DiscoverableMetadataProvider*>(&(*m));
+                    if (d) {
+                        Locker locker(d);
+                        tags += d->getCacheTag();
+                        tags += '\n';
+                    }
+                }
+                return SecurityHelper::doHash("SHA1", tags.data(), tags.length());
             }
 
             void outputFeed(ostream& os, bool& first, bool wrapArray=true) const {
@@ -97,14 +120,50 @@ namespace opensaml {
                     os << "\n]";
             }
 
+            void outputCompressedFeed(ostream& os, bool& first, unsigned long& crc, unsigned long& length, bool wrapArray=true) const {
+                if (wrapArray)
+                    openCompressedFeed(os, crc, length);
+                // Each provider's compressed feed is spliced in as is.
+                for (ptr_vector<MetadataProvider>::iterator m = m_providers.begin(); m != m_providers.end(); ++m) {
+                    DiscoverableMetadataProvider* d = dynamic_cast<DiscoverableMetadataProvider*>(&(*m));
+                    if (d) {
+                        Locker locker(d);
+                        d->outputCompressedFeed(os, first, crc, length, false);
+                    }
+                }
+                if (wrapArray)
+                    closeCompressedFeed(os, crc, length);
+            }
+
+            unsigned long searchFeed(const char* query, const char* lang, vector< pair<unsigned int,string> >& results, unsigned long max) const {
+                // Each provider supplies its best entries, and the best of those are kept.
+                unsigned long total = 0;
+                vector< pair<unsigned int,string> > found;
+                for (ptr_vector<MetadataProvider>::iterator m = m_providers.begin(); m != m_providers.end(); ++m) {
+                    DiscoverableMetadataProvider* d = dynamic_cast<DiscoverableMetadataProvider*>(&(*m));
+                    if (d) {
+                        Locker locker(d);
+                        total += d->searchFeed(query, lang, found, max);
+                    }
+                }
+                stable_sort(found.begin(), found.end(), boost::bind(&pair<unsigned int,string>::first, _1) > boost::bind(&pair<unsigned int,string>::first, _2));
+                if (found.size() > max)
+                    found.resize(max);
+                results.insert(results.end(), found.begin(), found.end());
+                return total;
+            }
+
             void onEvent(const ObservableMetadataProvider& provider) const {
-                // Reset the cache tag for the feed.
-                Lock lock(m_trackerLock);
-                SAMLConfig::getConfig().generateRandomBytes(m_feedTag, 4);
-                m_feedTag = SAMLArtifact::toHex(m_feedTag);
+                reindex(provider);
                 emitChangeEvent();
             }
 
+            void onEvent(const ObservableMetadataProvider& provider, const EntityDescriptor& entity) const {
+                // Only one entity changed, so pass that along rather than invalidating everything downstream.
+                reindex(provider, entity);
+                emitChangeEvent(entity);
+            }
+
         protected:
             void generateFeed() {
                 // No-op.
@@ -112,6 +171,8 @@ namespace opensaml {
 
         private:
             bool m_firstMatch;
+            unsigned int m_initThreads;
+            static void* init_fn(void*);
             mutable auto_ptr<Mutex> m_trackerLock;
             auto_ptr<ThreadKey> m_tlsKey;
             mutable ptr_vector<MetadataProvider> m_providers;
@@ -119,38 +180,68 @@ namespace opensaml {
             static void tracker_cleanup(void*);
             Category& m_log;
             friend struct tracker_t;
+
+            // Merged entityID index recording which providers hold each entity. Providers that can't
+            // enumerate their entities are never marked enumerable and so are always searched.
+            typedef boost::unordered_map< string,vector<ptr_vector<MetadataProvider>::size_type> > chainindex_t;
+            mutable auto_ptr<RWLock> m_indexLock;
+            mutable chainindex_t m_index;
+            mutable vector<bool> m_enumerable;
+            mutable vector< vector<string> > m_indexedIDs;
+            ptr_vector<MetadataProvider>::size_type getPosition(const MetadataProvider& provider) const;
+            void reindex(const MetadataProvider& provider) const;
+            void reindex(const MetadataProvider& provider, const EntityDescriptor& entity) const;
+            bool selectProviders(const Criteria& criteria, vector<bool>& selected) const;
         };
 
+        // A thread rarely holds more than a handful of providers and entities at once, so flat
+        // vectors that keep their capacity across unlock() avoid allocating on every lookup.
         struct SAML_DLLLOCAL tracker_t {
             tracker_t(const ChainingMetadataProvider* m) : m_metadata(m) {
                 Lock lock(m_metadata->m_trackerLock);
                 m_metadata->m_trackers.insert(this);
+                m_locked.reserve(m_metadata->m_providers.size());
+                m_objectMap.reserve(4);
+            }
+
+            bool holding(MetadataProvider* m) const {
+                return find(m_locked.begin(), m_locked.end(), m) != m_locked.end();
             }
 
             void lock_if(MetadataProvider* m) {
-                if (m_locked.count(m) == 0)
+                if (!holding(m))
                     m->lock();
             }
 
             void unlock_if(MetadataProvider* m) {
-                if (m_locked.count(m) == 0)
+                if (!holding(m))
                     m->unlock();
             }
 
             void remember(MetadataProvider* m, const EntityDescriptor* entity=nullptr) {
-                m_locked.insert(m);
-                if (entity)
-                    m_objectMap.insert(pair<const XMLObject*,const MetadataProvider*>(entity,m));
+                if (!holding(m))
+                    m_locked.push_back(m);
+                if (entity && !getProvider(entity))
+                    m_objectMap.push_back(make_pair(entity, m));
             }
 
-            const MetadataProvider* getProvider(const RoleDescriptor& role) {
-                map<const XMLObject*,const MetadataProvider*>::const_iterator i = m_objectMap.find(role.getParent());
-                return (i != m_objectMap.end()) ? i->second : nullptr;
+            const MetadataProvider* getProvider(const XMLObject* entity) const {
+                for (vector< pair<const XMLObject*,const MetadataProvider*> >::const_iterator i = m_objectMap.begin();
+                        i != m_objectMap.end(); ++i) {
+                    if (i->first == entity)
+                        return i->second;
+                }
+                return nullptr;
+            }
+
+            const MetadataProvider* getProvider(const RoleDescriptor& role) const {
+                return getProvider(role.getParent());
             }
 
             const ChainingMetadataProvider* m_metadata;
-            set<MetadataProvider*> m_locked;
-            map<const XMLObject*,const MetadataProvider*> m_objectMap;
+            vector<MetadataProvider*> m_locked;
+            vector< pair<const XMLObject*,const MetadataProvider*> > m_objectMap;
+            vector<bool> m_selected;
         };
 
         MetadataProvider* SAML_DLLLOCAL ChainingMetadataProviderFactory(const DOMElement* const & e)
@@ -159,6 +250,7 @@ namespace opensaml {
         }
 
         static const XMLCh _MetadataProvider[] =    UNICODE_LITERAL_16(M,e,t,a,d,a,t,a,P,r,o,v,i,d,e,r);
+        static const XMLCh initThreads[] =          UNICODE_LITERAL_11(i,n,i,t,T,h,r,e,a,d,s);
         static const XMLCh precedence[] =           UNICODE_LITERAL_10(p,r,e,c,e,d,e,n,c,e);
         static const XMLCh last[] =                 UNICODE_LITERAL_4(l,a,s,t);
         static const XMLCh _type[] =                 UNICODE_LITERAL_4(t,y,p,e);
@@ -177,8 +269,9 @@ void ChainingMetadataProvider::tracker_cleanup(void* ptr)
 }
 
 ChainingMetadataProvider::ChainingMetadataProvider(const DOMElement* e)
-    : ObservableMetadataProvider(e), m_firstMatch(true), m_trackerLock(Mutex::create()), m_tlsKey(ThreadKey::create(tracker_cleanup)),
-        m_log(Category::getInstance(SAML_LOGCAT".Metadata.Chaining"))
+    : ObservableMetadataProvider(e), m_firstMatch(true), m_initThreads(XMLHelper::getAttrInt(e, 1, initThreads)),
+        m_trackerLock(Mutex::create()), m_tlsKey(ThreadKey::create(tracker_cleanup)),
+        m_log(Category::getInstance(SAML_LOGCAT".Metadata.Chaining")), m_indexLock(RWLock::create())
 {
     if (XMLString::equals(e ? e->getAttributeNS(nullptr, precedence) : nullptr, last))
         m_firstMatch = false;
@@ -205,6 +298,9 @@ ChainingMetadataProvider::ChainingMetadataProvider(const DOMElement* e)
         }
         e = XMLHelper::getNextSiblingElement(e, _MetadataProvider);
     }
+
+    m_enumerable.resize(m_providers.size(), false);
+    m_indexedIDs.resize(m_providers.size());
 }
 
 ChainingMetadataProvider::~ChainingMetadataProvider()
@@ -218,20 +314,56 @@ void ChainingMetadataProvider::setContext(const MetadataFilterContext* ctx)
     for_each(m_providers.begin(), m_providers.end(), boost::bind(&MetadataProvider::setContext, _1, ctx));
 }
 
-void ChainingMetadataProvider::init()
+void* ChainingMetadataProvider::init_fn(void* pv)
 {
-    for (ptr_vector<MetadataProvider>::iterator i = m_providers.begin(); i != m_providers.end(); ++i) {
+    initializer_t* ctx = reinterpret_cast<initializer_t*>(pv);
+
+#ifndef WIN32
+    // First, let's block all signals
+    Thread::mask_all_signals();
+#endif
+
+    while (true) {
+        ptr_vector<MetadataProvider>::size_type pos;
+        {
+            Lock lock(ctx->m_lock);
+            if (ctx->m_next >= ctx->m_providers.size())
+                break;
+            pos = ctx->m_next++;
+        }
         try {
-            i->init();
+            ctx->m_providers[pos].init();
         }
         catch (std::exception& ex) {
-            m_log.crit("failure initializing MetadataProvider: %s", ex.what());
+            ctx->m_log.crit("failure initializing MetadataProvider: %s", ex.what());
         }
     }
+    return nullptr;
+}
 
-    // Set an initial cache tag for the state of the plugins.
-    SAMLConfig::getConfig().generateRandomBytes(m_feedTag, 4);
-    m_feedTag = SAMLArtifact::toHex(m_feedTag);
+void ChainingMetadataProvider::init()
+{
+    // Providers are independent until they're searched, so they can load side by side.
+    initializer_t ctx(m_providers, m_log);
+    unsigned int threads = min<unsigned int>(m_initThreads, m_providers.size());
+    if (threads > 1) {
+        m_log.info("initializing %lu MetadataProviders using %u threads", (unsigned long)m_providers.size(), threads);
+        vector<Thread*> initializers;
+        for (unsigned int t = 0; t < threads; ++t)
+            initializers.push_back(Thread::create(&init_fn, &ctx));
+        for (vector<Thread*>::iterator t = initializers.begin(); t != initializers.end(); ++t) {
+            (*t)->join(nullptr);
+            delete *t;
+        }
+    }
+    else {
+        init_fn(&ctx);
+    }
+
+    for (ptr_vector<MetadataProvider>::iterator i = m_providers.begin(); i != m_providers.end(); ++i) {
+        Locker locker(&(*i));
+        reindex(*i);
+    }
 }
 
 void ChainingMetadataProvider::outputStatus(ostream& os) const
@@ -256,6 +388,97 @@ void ChainingMetadataProvider::unlock()
     }
 }
 
+ptr_vector<MetadataProvider>::size_type ChainingMetadataProvider::getPosition(const MetadataProvider& provider) const
+{
+    ptr_vector<MetadataProvider>::size_type pos = 0;
+    while (pos < m_providers.size() && &m_providers[pos] != &provider)
+        ++pos;
+    return pos;
+}
+
+void ChainingMetadataProvider::reindex(const MetadataProvider& provider) const
+{
+    // Called with the provider locked.
+    ptr_vector<MetadataProvider>::size_type pos = getPosition(provider);
+    if (pos == m_providers.size())
+        return;
+
+    vector<string> ids;
+    const AbstractMetadataProvider* amp = dynamic_cast<const AbstractMetadataProvider*>(&provider);
+    bool enumerable = amp && amp->getEntityIDs(ids);
+
+    m_indexLock->wrlock();
+    SharedLock locker(m_indexLock.get(), false);
+
+    // Drop whatever the provider held before.
+    for (vector<string>::const_iterator id = m_indexedIDs[pos].begin(); id != m_indexedIDs[pos].end(); ++id) {
+        chainindex_t::iterator entry = m_index.find(*id);
+        if (entry != m_index.end()) {
+            entry->second.erase(remove(entry->second.begin(), entry->second.end(), pos), entry->second.end());
+            if (entry->second.empty())
+                m_index.erase(entry);
+        }
+    }
+
+    for (vector<string>::const_iterator id = ids.begin(); id != ids.end(); ++id)
+        m_index[*id].push_back(pos);
+    m_indexedIDs[pos].swap(ids);
+    m_enumerable[pos] = enumerable;
+
+    if (enumerable)
+        m_log.debug("indexed %lu entities from MetadataProvider %lu", (unsigned long)m_indexedIDs[pos].size(), (unsigned long)pos + 1);
+    else
+        m_log.debug("MetadataProvider %lu can't enumerate its entities, it will be searched for every entity", (unsigned long)pos + 1);
+}
+
+void ChainingMetadataProvider::reindex(const MetadataProvider& provider, const EntityDescriptor& entity) const
+{
+    // Called with the provider locked, possibly before the entity is visible in it. Providers
+    // that aren't enumerable are searched regardless, and for the rest an entry is only ever
+    // added here, since a spare entry costs a lookup but a missing one would hide the entity.
+    ptr_vector<MetadataProvider>::size_type pos = getPosition(provider);
+    auto_ptr_char id(entity.getEntityID());
+    if (pos == m_providers.size() || !id.get())
+        return;
+
+    m_indexLock->wrlock();
+    SharedLock locker(m_indexLock.get(), false);
+    if (!m_enumerable[pos])
+        return;
+    vector<ptr_vector<MetadataProvider>::size_type>& positions = m_index[id.get()];
+    if (find(positions.begin(), positions.end(), pos) == positions.end()) {
+        positions.push_back(pos);
+        m_indexedIDs[pos].push_back(id.get());
+    }
+}
+
+bool ChainingMetadataProvider::selectProviders(const Criteria& criteria, vector<bool>& selected) const
+{
+    // Artifact sources aren't indexed, so those lookups search every provider.
+    string id;
+    if (criteria.entityID_ascii) {
+        id = criteria.entityID_ascii;
+    }
+    else if (criteria.entityID_unicode) {
+        auto_ptr_char temp(criteria.entityID_unicode);
+        id = temp.get();
+    }
+    else {
+        return false;
+    }
+
+    SharedLock locker(m_indexLock.get());
+    selected.assign(m_enumerable.size(), false);
+    for (vector<bool>::size_type i = 0; i < m_enumerable.size(); ++i)
+        selected[i] = !m_enumerable[i];
+    chainindex_t::const_iterator entry = m_index.find(id);
+    if (entry != m_index.end()) {
+        for (vector<ptr_vector<MetadataProvider>::size_type>::const_iterator pos = entry->second.begin(); pos != entry->second.end(); ++pos)
+            selected[*pos] = true;
+    }
+    return true;
+}
+
 const XMLObject* ChainingMetadataProvider::getMetadata() const
 {
     throw MetadataException("getMetadata operation not implemented on this provider.");
@@ -322,11 +545,16 @@ pair<const EntityDescriptor*,const RoleDescriptor*> ChainingMetadataProvider::ge
         m_tlsKey->setData(tracker);
     }
 
+    // Narrow the search to the providers that might hold the entity.
+    bool indexed = selectProviders(criteria, tracker->m_selected);
+
     // Do a search.
     MetadataProvider* held = nullptr;
     pair<const EntityDescriptor*,const RoleDescriptor*> ret = pair<const EntityDescriptor*,const RoleDescriptor*>(nullptr,nullptr);
     pair<const EntityDescriptor*,const RoleDescriptor*> cur = ret;
     for (ptr_vector<MetadataProvider>::iterator i = m_providers.begin(); i != m_providers.end(); ++i) {
+        if (indexed && !tracker->m_selected[i - m_providers.begin()])
+            continue;
         tracker->lock_if(&(*i));
         cur = i->getEntityDescriptor(criteria);
         if (cur.first) {
@@ -25,19 +25,22 @@
  */
 
 #include "internal.h"
-#include "binding/SAMLArtifact.h"
 #include "saml2/metadata/EntityMatcher.h"
 #include "saml2/metadata/Metadata.h"
 #include "saml2/metadata/DiscoverableMetadataProvider.h"
 
+#include <algorithm>
+#include <climits>
 #include <fstream>
-#include <sstream>
+#include <boost/lexical_cast.hpp>
 #include <boost/lambda/bind.hpp>
 #include <boost/lambda/casts.hpp>
 #include <boost/lambda/lambda.hpp>
 #include <boost/iterator/indirect_iterator.hpp>
+#include <zlib.h>
 #include <xmltooling/logging.h>
 #include <xmltooling/XMLToolingConfig.h>
+#include <xmltooling/security/SecurityHelper.h>
 
 using namespace opensaml::saml2;
 using namespace opensaml::saml2md;
@@ -47,16 +50,21 @@ using namespace boost::lambda;
 using namespace boost;
 using namespace std;
 
-DiscoverableMetadataProvider::DiscoverableMetadataProvider(const DOMElement* e) : MetadataProvider(e), m_legacyOrgNames(false)
+DiscoverableMetadataProvider::DiscoverableMetadataProvider(const DOMElement* e)
+    : MetadataProvider(e), m_feedCRC(0), m_legacyOrgNames(false), m_entityAttributes(false), m_compressFeed(false), m_searchableFeed(false)
 {
     static const XMLCh legacyOrgNames[] =   UNICODE_LITERAL_14(l,e,g,a,c,y,O,r,g,N,a,m,e,s);
     static const XMLCh matcher[] =          UNICODE_LITERAL_7(m,a,t,c,h,e,r);
     static const XMLCh tagsInFeed[] =       UNICODE_LITERAL_10(t,a,g,s,I,n,F,e,e,d);
     static const XMLCh _type[] =            UNICODE_LITERAL_4(t,y,p,e);
     static const XMLCh DiscoveryFilter[] =  UNICODE_LITERAL_15(D,i,s,c,o,v,e,r,y,F,i,l,t,e,r);
+    static const XMLCh compressFeed[] =     UNICODE_LITERAL_12(c,o,m,p,r,e,s,s,F,e,e,d);
+    static const XMLCh searchableFeed[] =   UNICODE_LITERAL_14(s,e,a,r,c,h,a,b,l,e,F,e,e,d);
 
     m_legacyOrgNames = XMLHelper::getAttrBool(e, false, legacyOrgNames);
     m_entityAttributes = XMLHelper::getAttrBool(e, false, tagsInFeed);
+    m_compressFeed = XMLHelper::getAttrBool(e, false, compressFeed);
+    m_searchableFeed = XMLHelper::getAttrBool(e, false, searchableFeed);
 
     e = e ? XMLHelper::getFirstChildElement(e, DiscoveryFilter) : nullptr;
     while (e) {
@@ -91,16 +99,121 @@ DiscoverableMetadataProvider::~DiscoverableMetadataProvider()
 {
 }
 
+namespace {
+    // Compresses a piece of the feed into raw deflate blocks that stop on a byte boundary without
+    // ending the stream, so that pieces compressed separately can be concatenated.
+    static void deflate_piece(const string& in, string& out)
+    {
+        out.erase();
+        if (in.empty())
+            return;
+
+        z_stream z;
+        memset(&z, 0, sizeof(z_stream));
+        int ret = deflateInit2(&z, 9, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY);
+        if (ret != Z_OK) {
+            Category::getInstance(SAML_LOGCAT".MetadataProvider.Discoverable").error(
+                "zlib deflateInit2 failed with error code (%d)", ret
+                );
+            throw MetadataException("Unable to compress discovery feed.");
+        }
+
+        z.next_in = (Bytef*)in.data();
+        z.avail_in = in.length();
+        Bytef buf[16384];
+        do {
+            z.next_out = buf;
+            z.avail_out = sizeof(buf);
+            ret = deflate(&z, Z_SYNC_FLUSH);
+            out.append((const char*)buf, sizeof(buf) - z.avail_out);
+        } while (ret == Z_OK && z.avail_out == 0);
+        deflateEnd(&z);
+    }
+
+    // Outputs a short piece of the feed as a stored (uncompressed) deflate block.
+    static void deflate_stored(ostream& os, const char* buf, unsigned short len, bool final, unsigned long& crc, unsigned long& length)
+    {
+        os.put(final ? 1 : 0);
+        os.put(len & 0xff);
+        os.put((len >> 8) & 0xff);
+        os.put(~len & 0xff);
+        os.put((~len >> 8) & 0xff);
+        os.write(buf, len);
+        crc = crc32(crc, (const Bytef*)buf, len);
+        length += len;
+    }
+
+    static void put_uint32(ostream& os, unsigned long val)
+    {
+        for (int i = 0; i < 4; ++i, val >>= 8)
+            os.put(val & 0xff);
+    }
+
+    // Splits UTF-8 text into lowercased words; anything outside ASCII is kept as part of a word.
+    static void split_words(const char* text, vector<string>& words)
+    {
+        string word;
+        for (; text && *text; ++text) {
+            char c = *text;
+            if (c >= 'A' && c <= 'Z') {
+                word += c - 'A' + 'a';
+            }
+            else if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || (c & 0x80)) {
+                word += c;
+            }
+            else if (!word.empty()) {
+                words.push_back(word);
+                word.erase();
+            }
+        }
+        if (!word.empty())
+            words.push_back(word);
+    }
+
+    // Search weights of the places a word can come from.
+    static const unsigned int WEIGHT_DISPLAYNAME = 8;
+    static const unsigned int WEIGHT_KEYWORD = 4;
+    static const unsigned int WEIGHT_DOMAINHINT = 4;
+    static const unsigned int WEIGHT_ENTITYID = 2;
+    static const unsigned int WEIGHT_TAG = 1;
+
+    static bool by_rank(const pair<unsigned int,unsigned int>& a, const pair<unsigned int,unsigned int>& b)
+    {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    }
+
+    static bool by_rank_only(const pair<unsigned int,string>& a, const pair<unsigned int,string>& b)
+    {
+        return a.first > b.first;
+    }
+};
+
 void DiscoverableMetadataProvider::generateFeed()
 {
     m_feed.erase();
+    m_feedEntries.clear();
+    m_searchIndex.clear();
     bool first = true;
     const XMLObject* object = getMetadata();
     discoGroup(m_feed, dynamic_cast<const EntitiesDescriptor*>(object), first);
     discoEntity(m_feed, dynamic_cast<const EntityDescriptor*>(object), first);
 
-    SAMLConfig::getConfig().generateRandomBytes(m_feedTag, 4);
-    m_feedTag = SAMLArtifact::toHex(m_feedTag);
+    // Entries that weren't used this time are dropped.
+    m_lastFragments.swap(m_fragments);
+    m_fragments.clear();
+
+    // The tag identifies the content, so regenerating an identical feed keeps clients' copies valid.
+    m_feedTag = SecurityHelper::doHash("SHA1", m_feed.data(), m_feed.length());
+    m_feedCRC = crc32(crc32(0, nullptr, 0), (const Bytef*)m_feed.data(), m_feed.length());
+    if (m_compressFeed)
+        deflate_piece(m_feed, m_compressedFeed);
+    else
+        m_compressedFeed.erase();
+}
+
+string DiscoverableMetadataProvider::getFeedKey(const EntityDescriptor&) const
+{
+    return string();
 }
 
 string DiscoverableMetadataProvider::getCacheTag() const
@@ -123,40 +236,235 @@ void DiscoverableMetadataProvider::outputFeed(ostream& os, bool& first, bool wra
         os << "\n]";
 }
 
+void DiscoverableMetadataProvider::outputCompressedFeed(
+    ostream& os, bool& first, unsigned long& crc, unsigned long& length, bool wrapArray
+    ) const
+{
+    if (wrapArray)
+        openCompressedFeed(os, crc, length);
+    if (!m_feed.empty()) {
+        if (first)
+            first = false;
+        else
+            deflate_stored(os, ",\n", 2, false, crc, length);
+        if (m_compressedFeed.empty()) {
+            string piece;
+            deflate_piece(m_feed, piece);
+            os << piece;
+        }
+        else {
+            os << m_compressedFeed;
+        }
+        crc = crc32_combine(crc, m_feedCRC, m_feed.length());
+        length += m_feed.length();
+    }
+    if (wrapArray)
+        closeCompressedFeed(os, crc, length);
+}
+
+void DiscoverableMetadataProvider::openCompressedFeed(ostream& os, unsigned long& crc, unsigned long& length)
+{
+    // gzip member header: deflate, no flags or timestamp, unknown OS
+    static const char header[] = { '\x1f', '\x8b', '\x08', 0, 0, 0, 0, 0, 0, '\xff' };
+    os.write(header, sizeof(header));
+    crc = crc32(0, nullptr, 0);
+    length = 0;
+    deflate_stored(os, "[", 1, false, crc, length);
+}
+
+void DiscoverableMetadataProvider::closeCompressedFeed(ostream& os, unsigned long& crc, unsigned long& length)
+{
+    deflate_stored(os, "\n]", 2, true, crc, length);
+    put_uint32(os, crc);
+    put_uint32(os, length);
+}
+
+unsigned long DiscoverableMetadataProvider::searchFeed(
+    const char* query, const char* lang, vector< pair<unsigned int,string> >& results, unsigned long max
+    ) const
+{
+    vector<string> words;
+    split_words(query, words);
+    if (words.empty() || m_searchIndex.empty())
+        return 0;
+
+    // Each word scores an entry by the best place it's found in, and an entry has to have them all.
+    map<unsigned int,unsigned int> ranks;
+    for (vector<string>::const_iterator w = words.begin(); w != words.end(); ++w) {
+        map<unsigned int,unsigned int> hits;
+        for (map< string,vector<posting_t> >::const_iterator i = m_searchIndex.lower_bound(*w);
+                i != m_searchIndex.end() && i->first.compare(0, w->length(), *w) == 0; ++i) {
+            for (vector<posting_t>::const_iterator p = i->second.begin(); p != i->second.end(); ++p) {
+                if (w != words.begin() && ranks.find(p->m_entry) == ranks.end())
+                    continue;
+                unsigned int weight = p->m_weight;
+                if (i->first.length() == w->length())
+                    weight *= 2;
+                if (lang && *lang && p->m_lang == lang)
+                    weight *= 2;
+                unsigned int& best = hits[p->m_entry];
+                if (weight > best)
+                    best = weight;
+            }
+        }
+        for (map<unsigned int,unsigned int>::iterator h = hits.begin(); h != hits.end(); ++h) {
+            if (w != words.begin())
+                h->second += ranks[h->first];
+        }
+        ranks.swap(hits);
+        if (ranks.empty())
+            return 0;
+    }
+
+    vector< pair<unsigned int,unsigned int> > ranked;
+    ranked.reserve(ranks.size());
+    for (map<unsigned int,unsigned int>::const_iterator r = ranks.begin(); r != ranks.end(); ++r)
+        ranked.push_back(make_pair(r->second, r->first));
+    sort(ranked.begin(), ranked.end(), by_rank);
+    if (ranked.size() > max)
+        ranked.resize(max);
+    for (vector< pair<unsigned int,unsigned int> >::const_iterator r = ranked.begin(); r != ranked.end(); ++r) {
+        const pair<string::size_type,string::size_type>& entry = m_feedEntries[r->second];
+        results.push_back(make_pair(r->first, m_feed.substr(entry.first, entry.second)));
+    }
+    return ranks.size();
+}
+
+unsigned long DiscoverableMetadataProvider::outputSearch(
+    ostream& os, const char* query, const char* lang, unsigned long offset, unsigned long limit
+    ) const
+{
+    vector< pair<unsigned int,string> > results;
+    unsigned long total = searchFeed(query, lang, results, (limit > ULONG_MAX - offset) ? ULONG_MAX : offset + limit);
+
+    // A provider that combines others may add results in any order, so this keeps the best of all of them.
+    stable_sort(results.begin(), results.end(), by_rank_only);
+
+    os << '[';
+    for (vector< pair<unsigned int,string> >::size_type i = offset; i < results.size() && i < offset + limit; ++i) {
+        if (i != offset)
+            os << ',';
+        os << results[i].second;
+    }
+    os << "\n]";
+    return total;
+}
+
 namespace {
+    // Appends the escape sequence for a character that can't appear as is in a JSON string.
+    static void json_escape(string& s, unsigned char c)
+    {
+        static const char hex[] = "0123456789abcdef";
+        switch (c) {
+            case '\\':
+            case '"':
+                s += '\\';
+                s += c;
+                break;
+            case '\b':
+                s += "\\b";
+                break;
+            case '\t':
+                s += "\\t";
+                break;
+            case '\n':
+                s += "\\n";
+                break;
+            case '\f':
+                s += "\\f";
+                break;
+            case '\r':
+                s += "\\r";
+                break;
+            default:
+                s += "\\u00";
+                s += hex[c >> 4];
+                s += hex[c & 0xf];
+        }
+    }
+
+    static inline bool json_clean(unsigned int c)
+    {
+        return c >= 0x20 && c != '"' && c != '\\';
+    }
+
     static string& json_safe(string& s, const char* buf)
     {
+        if (!buf)
+            return s;
+
+        // Runs of characters that need no escaping are appended in one go.
+        const char* run = buf;
         for (; *buf; ++buf) {
-            switch (*buf) {
-                case '\\':
-                case '"':
-                    s += '\\';
-                    s += *buf;
-                    break;
-                case '\b':
-                    s += "\\b";
-                    break;
-                case '\t':
-                    s += "\\t";
-                    break;
-                case '\n':
-                    s += "\\n";
-                    break;
-                case '\f':
-                    s += "\\f";
-                    break;
-                case '\r':
-                    s += "\\r";
-                    break;
-                default:
-                    s += *buf;
+            if (!json_clean(static_cast<unsigned char>(*buf))) {
+                s.append(run, buf - run);
+                json_escape(s, *buf);
+                run = buf + 1;
             }
         }
+        s.append(run, buf - run);
         return s;
     }
+
+    // Transcodes UTF-16 straight into the UTF-8 output while escaping it, saving a separate
+    // transcoding pass and buffer for each value.
+    static string& json_safe(string& s, const XMLCh* buf)
+    {
+        if (!buf)
+            return s;
+
+        s.reserve(s.length() + XMLString::stringLen(buf));
+        for (; *buf; ++buf) {
+            unsigned int c = *buf;
+            if (c < 0x80) {
+                if (json_clean(c))
+                    s += static_cast<char>(c);
+                else
+                    json_escape(s, c);
+                continue;
+            }
+            else if (c < 0x800) {
+                s += static_cast<char>(0xc0 | (c >> 6));
+                s += static_cast<char>(0x80 | (c & 0x3f));
+                continue;
+            }
+            else if (c >= 0xd800 && c <= 0xdbff && *(buf + 1) >= 0xdc00 && *(buf + 1) <= 0xdfff) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (*(++buf) - 0xdc00);
+                s += static_cast<char>(0xf0 | (c >> 18));
+                s += static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+            }
+            else {
+                // An unpaired surrogate can't be encoded, so it's replaced.
+                if (c >= 0xd800 && c <= 0xdfff)
+                    c = 0xfffd;
+                s += static_cast<char>(0xe0 | (c >> 12));
+            }
+            s += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+            s += static_cast<char>(0x80 | (c & 0x3f));
+        }
+        return s;
+    }
+};
+
+namespace {
+    // Group tags are rendered into each entity's entry but aren't part of its content.
+    static bool hasGroupAttributes(const EntityDescriptor& entity)
+    {
+        const EntitiesDescriptor* group = dynamic_cast<EntitiesDescriptor*>(entity.getParent());
+        while (group) {
+            const Extensions* exts = group->getExtensions();
+            if (exts) {
+                const vector<XMLObject*>& children = exts->getUnknownXMLObjects();
+                if (find_if(children, ll_dynamic_cast<EntityAttributes*>(_1) != ((EntityAttributes*)nullptr)))
+                    return true;
+            }
+            group = dynamic_cast<EntitiesDescriptor*>(group->getParent());
+        }
+        return false;
+    }
 };
 
-void DiscoverableMetadataProvider::discoEntity(string& s, const EntityDescriptor* entity, bool& first) const
+void DiscoverableMetadataProvider::discoEntity(string& s, const EntityDescriptor* entity, bool& first)
 {
     time_t now = time(nullptr);
     if (entity && entity->isValid(now)) {
@@ -171,212 +479,370 @@ void DiscoverableMetadataProvider::discoEntity(string& s, const EntityDescriptor
 
         const vector<IDPSSODescriptor*>& idps = entity->getIDPSSODescriptors();
         if (!idps.empty()) {
-            auto_ptr_char entityid(entity->getEntityID());
-            // Open a struct and output id: entityID.
             if (first)
                 first = false;
             else
                 s += ',';
-            s += "\n{\n \"entityID\": \"";
-            json_safe(s, entityid.get());
-            s += '\"';
-            bool extFound = false;
-            for (indirect_iterator<vector<IDPSSODescriptor*>::const_iterator> idp = make_indirect_iterator(idps.begin());
-                    !extFound && idp != make_indirect_iterator(idps.end()); ++idp) {
-                if (idp->isValid(now) && idp->getExtensions()) {
-                    const vector<XMLObject*>& exts =  const_cast<const Extensions*>(idp->getExtensions())->getUnknownXMLObjects();
-                    for (vector<XMLObject*>::const_iterator ext = exts.begin(); !extFound && ext != exts.end(); ++ext) {
-                        const UIInfo* info = dynamic_cast<UIInfo*>(*ext);
-                        if (info) {
-                            extFound = true;
-                            const vector<DisplayName*>& dispnames = info->getDisplayNames();
-                            if (!dispnames.empty()) {
-                                s += ",\n \"DisplayNames\": [";
-                                for (indirect_iterator<vector<DisplayName*>::const_iterator> dispname = make_indirect_iterator(dispnames.begin());
-                                        dispname != make_indirect_iterator(dispnames.end()); ++dispname) {
-                                    if (dispname.base() != dispnames.begin())
-                                        s += ',';
-                                    auto_arrayptr<char> val(toUTF8(dispname->getName()));
-                                    auto_ptr_char lang(dispname->getLang());
-                                    s += "\n  {\n  \"value\": \"";
-                                    json_safe(s, val.get());
-                                    s += "\",\n  \"lang\": \"";
-                                    s += lang.get();
-                                    s += "\"\n  }";
-                                }
-                                s += "\n ]";
-                            }
 
-                            const vector<Description*>& descs = info->getDescriptions();
-                            if (!descs.empty()) {
-                                s += ",\n \"Descriptions\": [";
-                                for (indirect_iterator<vector<Description*>::const_iterator> desc = make_indirect_iterator(descs.begin());
-                                        desc != make_indirect_iterator(descs.end()); ++desc) {
-                                    if (desc.base() != descs.begin())
-                                        s += ',';
-                                    auto_arrayptr<char> val(toUTF8(desc->getDescription()));
-                                    auto_ptr_char lang(desc->getLang());
-                                    s += "\n  {\n  \"value\": \"";
-                                    json_safe(s, val.get());
-                                    s += "\",\n  \"lang\": \"";
-                                    s += lang.get();
-                                    s += "\"\n  }";
-                                }
-                                s += "\n ]";
-                            }
+            // Reuse the entry from the last feed if the entity and the roles that count haven't changed.
+            const feedentry_t* entry = nullptr;
+            feedentry_t uncached;
+            string key = getFeedKey(*entity);
+            if (!key.empty()) {
+                if (m_entityAttributes && hasGroupAttributes(*entity)) {
+                    key.erase();
+                }
+                else {
+                    key += '\n';
+                    for (indirect_iterator<vector<IDPSSODescriptor*>::const_iterator> idp = make_indirect_iterator(idps.begin());
+                            idp != make_indirect_iterator(idps.end()); ++idp)
+                        key += idp->isValid(now) ? '1' : '0';
+                    // An entity repeated in this feed was rendered already, and one from the last feed is moved over.
+                    boost::unordered_map<string,feedentry_t>::iterator fragment = m_fragments.find(key);
+                    if (fragment != m_fragments.end()) {
+                        entry = &fragment->second;
+                    }
+                    else if ((fragment = m_lastFragments.find(key)) != m_lastFragments.end()) {
+                        feedentry_t& reused = m_fragments[key];
+                        reused.m_json.swap(fragment->second.m_json);
+                        reused.m_terms.swap(fragment->second.m_terms);
+                        m_lastFragments.erase(fragment);
+                        entry = &reused;
+                    }
+                }
+            }
 
-                            const vector<Keywords*>& keywords = info->getKeywordss();
-                            if (!keywords.empty()) {
-                                s += ",\n \"Keywords\": [";
-                                for (indirect_iterator<vector<Keywords*>::const_iterator> words = make_indirect_iterator(keywords.begin());
-                                        words != make_indirect_iterator(keywords.end()); ++words) {
-                                    if (words.base() != keywords.begin())
-                                        s += ',';
-                                    auto_arrayptr<char> val(toUTF8(words->getValues()));
-                                    auto_ptr_char lang(words->getLang());
-                                    s += "\n  {\n  \"value\": \"";
-                                    json_safe(s, val.get());
-                                    s += "\",\n  \"lang\": \"";
-                                    s += lang.get();
-                                    s += "\"\n  }";
-                                }
-                                s += "\n ]";
-                            }
+            if (!entry) {
+                feedentry_t& fragment = key.empty() ? uncached : m_fragments[key];
+                renderEntity(fragment, *entity, now);
+                entry = &fragment;
+            }
 
-                            const vector<InformationURL*>& infurls = info->getInformationURLs();
-                            if (!infurls.empty()) {
-                                s += ",\n \"InformationURLs\": [";
-                                for (indirect_iterator<vector<InformationURL*>::const_iterator> infurl = make_indirect_iterator(infurls.begin());
-                                        infurl != make_indirect_iterator(infurls.end()); ++infurl) {
-                                    if (infurl.base() != infurls.begin())
-                                        s += ',';
-                                    auto_ptr_char val(infurl->getURL());
-                                    auto_ptr_char lang(infurl->getLang());
-                                    s += "\n  {\n  \"value\": \"";
-                                    json_safe(s, val.get());
-                                    s += "\",\n  \"lang\": \"";
-                                    s += lang.get();
-                                    s += "\"\n  }";
-                                }
-                                s += "\n ]";
-                            }
+            if (m_searchableFeed) {
+                unsigned int pos = m_feedEntries.size();
+                m_feedEntries.push_back(make_pair(s.length(), entry->m_json.length()));
+                for (vector<searchterm_t>::const_iterator t = entry->m_terms.begin(); t != entry->m_terms.end(); ++t)
+                    m_searchIndex[t->m_word].push_back(posting_t(pos, *t));
+            }
+            s += entry->m_json;
+        }
+    }
+}
 
-                            const vector<PrivacyStatementURL*>& privs = info->getPrivacyStatementURLs();
-                            if (!privs.empty()) {
-                                s += ",\n \"PrivacyStatementURLs\": [";
-                                for (indirect_iterator<vector<PrivacyStatementURL*>::const_iterator> priv = make_indirect_iterator(privs.begin());
-                                        priv != make_indirect_iterator(privs.end()); ++priv) {
-                                    if (priv.base() != privs.begin())
-                                        s += ',';
-                                    auto_ptr_char val(priv->getURL());
-                                    auto_ptr_char lang(priv->getLang());
-                                    s += "\n  {\n  \"value\": \"";
-                                    json_safe(s, val.get());
-                                    s += "\",\n  \"lang\": \"";
-                                    s += lang.get();
-                                    s += "\"\n  }";
-                                }
-                                s += "\n ]";
-                            }
+void DiscoverableMetadataProvider::renderEntity(feedentry_t& entry, const EntityDescriptor& entity, time_t now) const
+{
+    string& s = entry.m_json;
+    const vector<IDPSSODescriptor*>& idps = entity.getIDPSSODescriptors();
+    // Open a struct and output id: entityID.
+    s += "\n{\n \"entityID\": \"";
+    json_safe(s, entity.getEntityID());
+    s += '\"';
+    bool extFound = false;
+    for (indirect_iterator<vector<IDPSSODescriptor*>::const_iterator> idp = make_indirect_iterator(idps.begin());
+            !extFound && idp != make_indirect_iterator(idps.end()); ++idp) {
+        if (idp->isValid(now) && idp->getExtensions()) {
+            const vector<XMLObject*>& exts =  const_cast<const Extensions*>(idp->getExtensions())->getUnknownXMLObjects();
+            for (vector<XMLObject*>::const_iterator ext = exts.begin(); !extFound && ext != exts.end(); ++ext) {
+                const UIInfo* info = dynamic_cast<UIInfo*>(*ext);
+                if (info) {
+                    extFound = true;
+                    const vector<DisplayName*>& dispnames = info->getDisplayNames();
+                    if (!dispnames.empty()) {
+                        s += ",\n \"DisplayNames\": [";
+                        for (indirect_iterator<vector<DisplayName*>::const_iterator> dispname = make_indirect_iterator(dispnames.begin());
+                                dispname != make_indirect_iterator(dispnames.end()); ++dispname) {
+                            if (dispname.base() != dispnames.begin())
+                                s += ',';
+                            s += "\n  {\n  \"value\": \"";
+                            json_safe(s, dispname->getName());
+                            s += "\",\n  \"lang\": \"";
+                            json_safe(s, dispname->getLang());
+                            s += "\"\n  }";
+                        }
+                        s += "\n ]";
+                    }
 
-                            const vector<Logo*>& logos = info->getLogos();
-                            if (!logos.empty()) {
-                                s += ",\n \"Logos\": [";
-                                for (indirect_iterator<vector<Logo*>::const_iterator> logo = make_indirect_iterator(logos.begin());
-                                        logo != make_indirect_iterator(logos.end()); ++logo) {
-                                    if (logo.base() != logos.begin())
-                                        s += ',';
-                                    s += "\n  {\n";
-                                    auto_ptr_char val(logo->getURL());
-                                    s += "  \"value\": \"";
-                                    json_safe(s, val.get());
-                                    ostringstream ht;
-                                    ht << logo->getHeight().second;
-                                    s += "\",\n  \"height\": \"";
-                                    s += ht.str();
-                                    ostringstream wt;
-                                    wt << logo->getWidth().second;
-                                    s += "\",\n  \"width\": \"";
-                                    s += wt.str();
-                                    s += '\"';
-                                    if (logo->getLang()) {
-                                        auto_ptr_char lang(logo->getLang());
-                                        s += ",\n  \"lang\": \"";
-                                        s += lang.get();
-                                        s += '\"';
-                                    }
-                                    s += "\n  }";
-                                }
-                                s += "\n ]";
-                            }
+                    const vector<Description*>& descs = info->getDescriptions();
+                    if (!descs.empty()) {
+                        s += ",\n \"Descriptions\": [";
+                        for (indirect_iterator<vector<Description*>::const_iterator> desc = make_indirect_iterator(descs.begin());
+                                desc != make_indirect_iterator(descs.end()); ++desc) {
+                            if (desc.base() != descs.begin())
+                                s += ',';
+                            s += "\n  {\n  \"value\": \"";
+                            json_safe(s, desc->getDescription());
+                            s += "\",\n  \"lang\": \"";
+                            json_safe(s, desc->getLang());
+                            s += "\"\n  }";
                         }
+                        s += "\n ]";
                     }
-                }
-            }
 
-            if (m_legacyOrgNames && !extFound) {
-                const Organization* org = nullptr;
-                for (indirect_iterator<vector<IDPSSODescriptor*>::const_iterator> idp = make_indirect_iterator(idps.begin());
-                        !org && idp != make_indirect_iterator(idps.end()); ++idp) {
-                    if (idp->isValid(now))
-                        org = idp->getOrganization();
-                }
-                if (!org)
-                    org = entity->getOrganization();
-                if (org) {
-                    const vector<OrganizationDisplayName*>& odns = org->getOrganizationDisplayNames();
-                    if (!odns.empty()) {
-                        s += ",\n \"DisplayNames\": [";
-                        for (indirect_iterator<vector<OrganizationDisplayName*>::const_iterator> dispname = make_indirect_iterator(odns.begin());
-                                dispname != make_indirect_iterator(odns.end()); ++dispname) {
-                            if (dispname.base() != odns.begin())
+                    const vector<Keywords*>& keywords = info->getKeywordss();
+                    if (!keywords.empty()) {
+                        s += ",\n \"Keywords\": [";
+                        for (indirect_iterator<vector<Keywords*>::const_iterator> words = make_indirect_iterator(keywords.begin());
+                                words != make_indirect_iterator(keywords.end()); ++words) {
+                            if (words.base() != keywords.begin())
                                 s += ',';
-                            auto_arrayptr<char> val(toUTF8(dispname->getName()));
-                            auto_ptr_char lang(dispname->getLang());
                             s += "\n  {\n  \"value\": \"";
-                            json_safe(s, val.get());
+                            json_safe(s, words->getValues());
                             s += "\",\n  \"lang\": \"";
-                            s += lang.get();
+                            json_safe(s, words->getLang());
                             s += "\"\n  }";
                         }
                         s += "\n ]";
                     }
+
+                    const vector<InformationURL*>& infurls = info->getInformationURLs();
+                    if (!infurls.empty()) {
+                        s += ",\n \"InformationURLs\": [";
+                        for (indirect_iterator<vector<InformationURL*>::const_iterator> infurl = make_indirect_iterator(infurls.begin());
+                                infurl != make_indirect_iterator(infurls.end()); ++infurl) {
+                            if (infurl.base() != infurls.begin())
+                                s += ',';
+                            s += "\n  {\n  \"value\": \"";
+                            json_safe(s, infurl->getURL());
+                            s += "\",\n  \"lang\": \"";
+                            json_safe(s, infurl->getLang());
+                            s += "\"\n  }";
+                        }
+                        s += "\n ]";
+                    }
+
+                    const vector<PrivacyStatementURL*>& privs = info->getPrivacyStatementURLs();
+                    if (!privs.empty()) {
+                        s += ",\n \"PrivacyStatementURLs\": [";
+                        for (indirect_iterator<vector<PrivacyStatementURL*>::const_iterator> priv = make_indirect_iterator(privs.begin());
+                                priv != make_indirect_iterator(privs.end()); ++priv) {
+                            if (priv.base() != privs.begin())
+                                s += ',';
+                            s += "\n  {\n  \"value\": \"";
+                            json_safe(s, priv->getURL());
+                            s += "\",\n  \"lang\": \"";
+                            json_safe(s, priv->getLang());
+                            s += "\"\n  }";
+                        }
+                        s += "\n ]";
+                    }
+
+                    const vector<Logo*>& logos = info->getLogos();
+                    if (!logos.empty()) {
+                        s += ",\n \"Logos\": [";
+                        for (indirect_iterator<vector<Logo*>::const_iterator> logo = make_indirect_iterator(logos.begin());
+                                logo != make_indirect_iterator(logos.end()); ++logo) {
+                            if (logo.base() != logos.begin())
+                                s += ',';
+                            s += "\n  {\n";
+                            s += "  \"value\": \"";
+                            json_safe(s, logo->getURL());
+                            s += "\",\n  \"height\": \"";
+                            s += lexical_cast<string>(logo->getHeight().second);
+                            s += "\",\n  \"width\": \"";
+                            s += lexical_cast<string>(logo->getWidth().second);
+                            s += '\"';
+                            if (logo->getLang()) {
+                                s += ",\n  \"lang\": \"";
+                                json_safe(s, logo->getLang());
+                                s += '\"';
+                            }
+                            s += "\n  }";
+                        }
+                        s += "\n ]";
+                    }
                 }
             }
+        }
+    }
 
-            if (m_entityAttributes) {
-                bool tagfirst = true;
-                // Check for an EntityAttributes extension in the entity and its parent(s).
-                const Extensions* exts = entity->getExtensions();
-                if (exts) {
-                    const vector<XMLObject*>& children = exts->getUnknownXMLObjects();
-                    const XMLObject* xo = find_if(children, ll_dynamic_cast<EntityAttributes*>(_1) != ((EntityAttributes*)nullptr));
-                    if (xo)
-                        discoEntityAttributes(s, *dynamic_cast<const EntityAttributes*>(xo), tagfirst);
+    if (m_legacyOrgNames && !extFound) {
+        const Organization* org = nullptr;
+        for (indirect_iterator<vector<IDPSSODescriptor*>::const_iterator> idp = make_indirect_iterator(idps.begin());
+                !org && idp != make_indirect_iterator(idps.end()); ++idp) {
+            if (idp->isValid(now))
+                org = idp->getOrganization();
+        }
+        if (!org)
+            org = entity.getOrganization();
+        if (org) {
+            const vector<OrganizationDisplayName*>& odns = org->getOrganizationDisplayNames();
+            if (!odns.empty()) {
+                s += ",\n \"DisplayNames\": [";
+                for (indirect_iterator<vector<OrganizationDisplayName*>::const_iterator> dispname = make_indirect_iterator(odns.begin());
+                        dispname != make_indirect_iterator(odns.end()); ++dispname) {
+                    if (dispname.base() != odns.begin())
+                        s += ',';
+                    s += "\n  {\n  \"value\": \"";
+                    json_safe(s, dispname->getName());
+                    s += "\",\n  \"lang\": \"";
+                    json_safe(s, dispname->getLang());
+                    s += "\"\n  }";
                 }
+                s += "\n ]";
+            }
+        }
+    }
 
-                const EntitiesDescriptor* group = dynamic_cast<EntitiesDescriptor*>(entity->getParent());
-                while (group) {
-                    exts = group->getExtensions();
-                    if (exts) {
-                        const vector<XMLObject*>& children = exts->getUnknownXMLObjects();
-                        const XMLObject* xo = find_if(children, ll_dynamic_cast<EntityAttributes*>(_1) != ((EntityAttributes*)nullptr));
-                        if (xo)
-                            discoEntityAttributes(s, *dynamic_cast<const EntityAttributes*>(xo), tagfirst);
-                    }
-                    group = dynamic_cast<EntitiesDescriptor*>(group->getParent());
+    if (m_entityAttributes) {
+        bool tagfirst = true;
+        // Check for an EntityAttributes extension in the entity and its parent(s).
+        const Extensions* exts = entity.getExtensions();
+        if (exts) {
+            const vector<XMLObject*>& children = exts->getUnknownXMLObjects();
+            const XMLObject* xo = find_if(children, ll_dynamic_cast<EntityAttributes*>(_1) != ((EntityAttributes*)nullptr));
+            if (xo)
+                discoEntityAttributes(s, *dynamic_cast<const EntityAttributes*>(xo), tagfirst);
+        }
+
+        const EntitiesDescriptor* group = dynamic_cast<EntitiesDescriptor*>(entity.getParent());
+        while (group) {
+            exts = group->getExtensions();
+            if (exts) {
+                const vector<XMLObject*>& children = exts->getUnknownXMLObjects();
+                const XMLObject* xo = find_if(children, ll_dynamic_cast<EntityAttributes*>(_1) != ((EntityAttributes*)nullptr));
+                if (xo)
+                    discoEntityAttributes(s, *dynamic_cast<const EntityAttributes*>(xo), tagfirst);
+            }
+            group = dynamic_cast<EntitiesDescriptor*>(group->getParent());
+        }
+        if (!tagfirst)
+            s += "\n ]";
+    }
+
+    // Close the struct;
+    s += "\n}";
+
+    if (m_searchableFeed)
+        collectTerms(entry.m_terms, entity, now);
+}
+
+void DiscoverableMetadataProvider::collectTerms(vector<searchterm_t>& terms, const EntityDescriptor& entity, time_t now) const
+{
+    vector<string> words;
+
+    // The whole entityID can be searched for as well as its parts.
+    auto_ptr_char entityid(entity.getEntityID());
+    if (entityid.get()) {
+        string id(entityid.get());
+        for (string::iterator c = id.begin(); c != id.end(); ++c) {
+            if (*c >= 'A' && *c <= 'Z')
+                *c = *c - 'A' + 'a';
+        }
+        terms.push_back(searchterm_t(id, WEIGHT_ENTITYID, nullptr));
+        split_words(entityid.get(), words);
+        for (vector<string>::const_iterator w = words.begin(); w != words.end(); ++w)
+            terms.push_back(searchterm_t(*w, WEIGHT_ENTITYID, nullptr));
+    }
+
+    // The names and keywords are taken from the UIInfo that was rendered, and hints from any valid role.
+    bool infoFound = false;
+    const vector<IDPSSODescriptor*>& idps = entity.getIDPSSODescriptors();
+    for (indirect_iterator<vector<IDPSSODescriptor*>::const_iterator> idp = make_indirect_iterator(idps.begin());
+            idp != make_indirect_iterator(idps.end()); ++idp) {
+        if (!idp->isValid(now) || !idp->getExtensions())
+            continue;
+        const vector<XMLObject*>& exts = const_cast<const Extensions*>(idp->getExtensions())->getUnknownXMLObjects();
+        for (vector<XMLObject*>::const_iterator ext = exts.begin(); ext != exts.end(); ++ext) {
+            const UIInfo* info = dynamic_cast<UIInfo*>(*ext);
+            if (info && !infoFound) {
+                infoFound = true;
+                const vector<DisplayName*>& dispnames = info->getDisplayNames();
+                for (indirect_iterator<vector<DisplayName*>::const_iterator> dispname = make_indirect_iterator(dispnames.begin());
+                        dispname != make_indirect_iterator(dispnames.end()); ++dispname) {
+                    auto_arrayptr<char> val(toUTF8(dispname->getName()));
+                    auto_ptr_char lang(dispname->getLang());
+                    words.clear();
+                    split_words(val.get(), words);
+                    for (vector<string>::const_iterator w = words.begin(); w != words.end(); ++w)
+                        terms.push_back(searchterm_t(*w, WEIGHT_DISPLAYNAME, lang.get()));
+                }
+                const vector<Keywords*>& keywords = info->getKeywordss();
+                for (indirect_iterator<vector<Keywords*>::const_iterator> kw = make_indirect_iterator(keywords.begin());
+                        kw != make_indirect_iterator(keywords.end()); ++kw) {
+                    auto_arrayptr<char> val(toUTF8(kw->getValues()));
+                    auto_ptr_char lang(kw->getLang());
+                    words.clear();
+                    split_words(val.get(), words);
+                    for (vector<string>::const_iterator w = words.begin(); w != words.end(); ++w)
+                        terms.push_back(searchterm_t(*w, WEIGHT_KEYWORD, lang.get()));
                 }
-                if (!tagfirst)
-                    s += "\n ]";
+                continue;
             }
 
-            // Close the struct;
-            s += "\n}";
+            const DiscoHints* hints = dynamic_cast<DiscoHints*>(*ext);
+            if (hints) {
+                const vector<DomainHint*>& domains = hints->getDomainHints();
+                for (indirect_iterator<vector<DomainHint*>::const_iterator> domain = make_indirect_iterator(domains.begin());
+                        domain != make_indirect_iterator(domains.end()); ++domain) {
+                    auto_ptr_char val(domain->getHint());
+                    words.clear();
+                    split_words(val.get(), words);
+                    for (vector<string>::const_iterator w = words.begin(); w != words.end(); ++w)
+                        terms.push_back(searchterm_t(*w, WEIGHT_DOMAINHINT, nullptr));
+                }
+            }
+        }
+    }
+
+    if (m_legacyOrgNames && !infoFound) {
+        const Organization* org = nullptr;
+        for (indirect_iterator<vector<IDPSSODescriptor*>::const_iterator> idp = make_indirect_iterator(idps.begin());
+                !org && idp != make_indirect_iterator(idps.end()); ++idp) {
+            if (idp->isValid(now))
+                org = idp->getOrganization();
+        }
+        if (!org)
+            org = entity.getOrganization();
+        if (org) {
+            const vector<OrganizationDisplayName*>& odns = org->getOrganizationDisplayNames();
+            for (indirect_iterator<vector<OrganizationDisplayName*>::const_iterator> dispname = make_indirect_iterator(odns.begin());
+                    dispname != make_indirect_iterator(odns.end()); ++dispname) {
+                auto_arrayptr<char> val(toUTF8(dispname->getName()));
+                auto_ptr_char lang(dispname->getLang());
+                words.clear();
+                split_words(val.get(), words);
+                for (vector<string>::const_iterator w = words.begin(); w != words.end(); ++w)
+                    terms.push_back(searchterm_t(*w, WEIGHT_DISPLAYNAME, lang.get()));
+            }
+        }
+    }
+
+    if (m_entityAttributes) {
+        // Tags can be searched for by value, from the entity and its parent(s).
+        const XMLObject* parent = &entity;
+        while (parent) {
+            const Extensions* exts = nullptr;
+            if (parent == &entity)
+                exts = entity.getExtensions();
+            else if (dynamic_cast<const EntitiesDescriptor*>(parent))
+                exts = dynamic_cast<const EntitiesDescriptor*>(parent)->getExtensions();
+            else
+                break;
+            if (exts) {
+                const vector<XMLObject*>& children = exts->getUnknownXMLObjects();
+                const XMLObject* xo = find_if(children, ll_dynamic_cast<EntityAttributes*>(_1) != ((EntityAttributes*)nullptr));
+                if (xo) {
+                    const vector<Attribute*>& attrs = dynamic_cast<const EntityAttributes*>(xo)->getAttributes();
+                    for (indirect_iterator<vector<Attribute*>::const_iterator> a = make_indirect_iterator(attrs.begin());
+                            a != make_indirect_iterator(attrs.end()); ++a) {
+                        const vector<XMLObject*>& vals = const_cast<const Attribute&>(*a).getAttributeValues();
+                        for (indirect_iterator<vector<XMLObject*>::const_iterator> v = make_indirect_iterator(vals.begin());
+                                v != make_indirect_iterator(vals.end()); ++v) {
+                            auto_arrayptr<char> val(toUTF8(v->getTextContent()));
+                            words.clear();
+                            split_words(val.get(), words);
+                            for (vector<string>::const_iterator w = words.begin(); w != words.end(); ++w)
+                                terms.push_back(searchterm_t(*w, WEIGHT_TAG, nullptr));
+                        }
+                    }
+                }
+            }
+            parent = parent->getParent();
         }
     }
 }
 
-void DiscoverableMetadataProvider::discoGroup(string& s, const EntitiesDescriptor* group, bool& first) const
+void DiscoverableMetadataProvider::discoGroup(string& s, const EntitiesDescriptor* group, bool& first)
 {
     if (group) {
         for_each(
@@ -415,19 +881,16 @@ void DiscoverableMetadataProvider::discoAttributes(std::string& s, const vector<
             s += ',';
         }
 
-        auto_ptr_char n(a->getName());
         s += "\n  {\n  \"name\": \"";
-        json_safe(s, n.get());
+        json_safe(s, a->getName());
         s += "\",\n  \"values\": [";
         const vector<XMLObject*>& vals = const_cast<const Attribute&>(*a).getAttributeValues();
         for (indirect_iterator<vector<XMLObject*>::const_iterator> v = make_indirect_iterator(vals.begin());
                 v != make_indirect_iterator(vals.end()); ++v) {
             if (v.base() != vals.begin())
                 s += ',';
-            auto_arrayptr<char> val(toUTF8(v->getTextContent()));
             s += "\n     \"";
-            if (val.get())
-                json_safe(s, val.get());
+            json_safe(s, v->getTextContent());
             s += '\"';
         }
         s += "\n  ]\n  }";
@@ -29,11 +29,19 @@
 #include "saml2/metadata/Metadata.h"
 #include "saml2/metadata/DynamicMetadataProvider.h"
 
+#include <algorithm>
+#include <fstream>
+#include <typeinfo>
+#include <boost/bind.hpp>
 #include <xercesc/framework/Wrapper4InputSource.hpp>
 #include <xercesc/util/XMLUniDefs.hpp>
 #include <xmltooling/logging.h>
 #include <xmltooling/XMLToolingConfig.h>
+#include <xmltooling/io/HTTPResponse.h>
+#include <xmltooling/security/SecurityHelper.h>
+#include <xmltooling/util/DateTime.h>
 #include <xmltooling/util/ParserPool.h>
+#include <xmltooling/util/PathResolver.h>
 #include <xmltooling/util/Threads.h>
 #include <xmltooling/util/XMLHelper.h>
 #include <xmltooling/validation/ValidatorSuite.h>
@@ -47,10 +55,15 @@ using namespace std;
 #  define min(a,b)            (((a) < (b)) ? (a) : (b))
 # endif
 
+static const XMLCh cacheDirectory[] =       UNICODE_LITERAL_14(c,a,c,h,e,D,i,r,e,c,t,o,r,y);
 static const XMLCh id[] =                   UNICODE_LITERAL_2(i,d);
 static const XMLCh maxCacheDuration[] =     UNICODE_LITERAL_16(m,a,x,C,a,c,h,e,D,u,r,a,t,i,o,n);
+static const XMLCh maxEntities[] =          UNICODE_LITERAL_11(m,a,x,E,n,t,i,t,i,e,s);
+static const XMLCh maxNegativeEntries[] =   UNICODE_LITERAL_18(m,a,x,N,e,g,a,t,i,v,e,E,n,t,r,i,e,s);
 static const XMLCh minCacheDuration[] =     UNICODE_LITERAL_16(m,i,n,C,a,c,h,e,D,u,r,a,t,i,o,n);
 static const XMLCh refreshDelayFactor[] =   UNICODE_LITERAL_18(r,e,f,r,e,s,h,D,e,l,a,y,F,a,c,t,o,r);
+static const XMLCh refreshQueueSize[] =     UNICODE_LITERAL_16(r,e,f,r,e,s,h,Q,u,e,u,e,S,i,z,e);
+static const XMLCh refreshThreads[] =       UNICODE_LITERAL_14(r,e,f,r,e,s,h,T,h,r,e,a,d,s);
 static const XMLCh validate[] =             UNICODE_LITERAL_8(v,a,l,i,d,a,t,e);
 
 namespace opensaml {
@@ -59,6 +72,27 @@ namespace opensaml {
         {
             return new DynamicMetadataProvider(e);
         }
+
+        // marks a lookup as in progress, and on the way out clears it and wakes anybody waiting on it
+        class SAML_DLLLOCAL resolving_t
+        {
+        public:
+            resolving_t(Mutex& lock, CondWait& cond, set<xstring>& resolving, const xstring& key)
+                : m_lock(lock), m_cond(cond), m_resolving(resolving), m_key(key) {
+            }
+
+            ~resolving_t() {
+                Lock lock(&m_lock);
+                m_resolving.erase(m_key);
+                m_cond.broadcast();
+            }
+
+        private:
+            Mutex& m_lock;
+            CondWait& m_cond;
+            set<xstring>& m_resolving;
+            const xstring& m_key;
+        };
     };
 };
 
@@ -69,8 +103,21 @@ DynamicMetadataProvider::DynamicMetadataProvider(const DOMElement* e)
         m_lock(RWLock::create()),
         m_refreshDelayFactor(0.75),
         m_minCacheDuration(XMLHelper::getAttrInt(e, 600, minCacheDuration)),
-        m_maxCacheDuration(XMLHelper::getAttrInt(e, 28800, maxCacheDuration))
+        m_maxCacheDuration(XMLHelper::getAttrInt(e, 28800, maxCacheDuration)),
+        m_maxEntities(XMLHelper::getAttrInt(e, 0, maxEntities)),
+        m_maxNegativeEntries(XMLHelper::getAttrInt(e, 0, maxNegativeEntries)),
+        m_entityCount(0), m_negativeCount(0),
+        m_cacheLock(Mutex::create()),
+        m_resolved(CondWait::create()),
+        m_refreshThreads(XMLHelper::getAttrInt(e, 0, refreshThreads)),
+        m_maxRefreshQueue(XMLHelper::getAttrInt(e, 100, refreshQueueSize)),
+        m_refreshAllowed(false), m_initialized(false),
+        m_activeRefreshes(0), m_failedRefreshes(0), m_lastScan(0), m_shutdown(false),
+        m_cacheDirectory(XMLHelper::getAttrString(e, nullptr, cacheDirectory))
 {
+    if (!m_cacheDirectory.empty())
+        XMLToolingConfig::getConfig().getPathResolver()->resolve(m_cacheDirectory, PathResolver::XMLTOOLING_CACHE_FILE);
+
     if (m_minCacheDuration > m_maxCacheDuration) {
         Category::getInstance(SAML_LOGCAT".MetadataProvider.Dynamic").error(
             "minCacheDuration setting exceeds maxCacheDuration setting, lowering to match it"
@@ -93,15 +140,44 @@ DynamicMetadataProvider::DynamicMetadataProvider(const DOMElement* e)
 
 DynamicMetadataProvider::~DynamicMetadataProvider()
 {
+    shutdown();
+
     // Each entity in the map is unique (no multimap semantics), so this is safe.
     clearDescriptorIndex(true);
 }
 
+void DynamicMetadataProvider::allowRefreshThreads()
+{
+    m_refreshAllowed = true;
+}
+
+void DynamicMetadataProvider::shutdown()
+{
+    vector<Thread*> refreshers;
+    {
+        Lock lock(m_cacheLock);
+        m_shutdown = true;
+        if (m_refreshWait.get())
+            m_refreshWait->broadcast();
+        refreshers.swap(m_refreshers);
+    }
+    for (vector<Thread*>::iterator t = refreshers.begin(); t != refreshers.end(); ++t) {
+        (*t)->join(nullptr);
+        delete *t;
+    }
+}
+
 const XMLObject* DynamicMetadataProvider::getMetadata() const
 {
     throw MetadataException("getMetadata operation not implemented on this provider.");
 }
 
+bool DynamicMetadataProvider::getEntityIDs(vector<string>& ids) const
+{
+    // Anything not yet cached can still be resolved, so there's no complete list.
+    return false;
+}
+
 Lockable* DynamicMetadataProvider::lock()
 {
     m_lock->rdlock();
@@ -115,6 +191,39 @@ void DynamicMetadataProvider::unlock()
 
 void DynamicMetadataProvider::init()
 {
+    // A subclass that hasn't opted in may not stop the threads before the resolve() they call is gone.
+    if (m_refreshThreads > 0 && !m_refreshAllowed && typeid(*this) != typeid(DynamicMetadataProvider)) {
+        Category::getInstance(SAML_LOGCAT".MetadataProvider.Dynamic").warn(
+            "refreshThreads setting is not supported by this provider, entities will be refreshed as they're looked up"
+            );
+        m_refreshThreads = 0;
+    }
+    m_initialized = true;
+}
+
+void DynamicMetadataProvider::outputStatus(ostream& os) const
+{
+    os << "<MetadataProvider";
+
+    if (getId() && *getId()) {
+        os << " id='" << getId() << "'";
+    }
+
+    if (m_lastUpdate > 0) {
+        DateTime ts(m_lastUpdate);
+        ts.parseDateTime();
+        auto_ptr_char timestamp(ts.getFormattedString());
+        os << " lastUpdate='" << timestamp.get() << "'";
+    }
+
+    Lock lock(m_cacheLock);
+    if (!m_refreshers.empty()) {
+        os << " pendingRefreshes='" << m_refreshQueue.size() << "'"
+            << " activeRefreshes='" << m_activeRefreshes << "'"
+            << " failedRefreshes='" << m_failedRefreshes << "'";
+    }
+
+    os << "/>";
 }
 
 const char* DynamicMetadataProvider::getId() const
@@ -132,100 +241,200 @@ pair<const EntityDescriptor*,const RoleDescriptor*> DynamicMetadataProvider::get
     // Check to see if we're within the caching interval for a lookup of this entity.
     // This applies *even if we didn't get a hit* because the cache map tracks failed
     // lookups also, to prevent constant reload attempts.
-    cachemap_t::iterator cit;
+    xstring key;
     if (entity.first) {
-        cit = m_cacheMap.find(entity.first->getEntityID());
+        key = entity.first->getEntityID();
     }
     else if (criteria.entityID_ascii) {
         auto_ptr_XMLCh widetemp(criteria.entityID_ascii);
-        cit = m_cacheMap.find(widetemp.get());
+        key = widetemp.get();
     }
     else if (criteria.entityID_unicode) {
-        cit = m_cacheMap.find(criteria.entityID_unicode);
+        key = criteria.entityID_unicode;
     }
     else if (criteria.artifact) {
         auto_ptr_XMLCh widetemp(criteria.artifact->getSource().c_str());
-        cit = m_cacheMap.find(widetemp.get());
-    }
-    else {
-        cit = m_cacheMap.end();
-    }
-    if (cit != m_cacheMap.end()) {
-        if (time(nullptr) <= cit->second)
-            return entity;
-        m_cacheMap.erase(cit);
-    }
-
-    string name;
-    if (criteria.entityID_ascii) {
-        name = criteria.entityID_ascii;
-    }
-    else if (criteria.entityID_unicode) {
-        auto_ptr_char temp(criteria.entityID_unicode);
-        name = temp.get();
-    }
-    else if (criteria.artifact) {
-        name = criteria.artifact->getSource();
+        key = widetemp.get();
     }
     else {
         return entity;
     }
 
-    if (entity.first)
-        log.info("metadata for (%s) is beyond caching interval, attempting to refresh", name.c_str());
-    else
-        log.info("resolving metadata for (%s)", name.c_str());
-
-    try {
-        // Try resolving it.
-        auto_ptr<EntityDescriptor> entity2(resolve(criteria));
+    bool waited = false;
+    {
+        Lock lock(m_cacheLock);
+        cachemap_t::iterator cit = m_cacheMap.find(key);
+        if (cit != m_cacheMap.end()) {
+            touch(cit->second);
+            if (time(nullptr) <= cit->second.m_refresh)
+                return entity;
+            // In the background, a new copy is fetched while the cached one is returned.
+            if (entity.first && !m_resolving.count(key) && queueRefresh(key))
+                return entity;
+        }
 
-        // Verify the entityID.
-        if (criteria.entityID_unicode && !XMLString::equals(criteria.entityID_unicode, entity2->getEntityID())) {
-            log.error("metadata instance did not match expected entityID");
-            return entity;
+        if (m_resolving.count(key)) {
+            // Another thread is resolving this entity, so make do with a cached copy,
+            // or give up the read lock it will need to upgrade and wait for its result.
+            if (entity.first)
+                return entity;
+            m_lock->unlock();
+            while (m_resolving.count(key))
+                m_resolved->wait(m_cacheLock.get());
+            waited = true;
         }
         else {
-            auto_ptr_XMLCh temp2(name.c_str());
-            if (!XMLString::equals(temp2.get(), entity2->getEntityID())) {
-                log.error("metadata instance did not match expected entityID");
-                return entity;
-            }
+            m_resolving.insert(key);
         }
+    }
 
-        // Preprocess the metadata (even if we schema-validated).
-        try {
-            SchemaValidators.validate(entity2.get());
+    if (waited) {
+        m_lock->rdlock();
+        return AbstractMetadataProvider::getEntityDescriptor(criteria);
+    }
+
+    {
+        // Waiters are released once this lookup is recorded in the cache, whatever the outcome,
+        // and before the lookup below, which mustn't find its own marker and wait on itself.
+        resolving_t resolving(*m_cacheLock, *m_resolved, m_resolving, key);
+
+        string name;
+        if (criteria.entityID_ascii) {
+            name = criteria.entityID_ascii;
+        }
+        else if (criteria.entityID_unicode) {
+            auto_ptr_char temp(criteria.entityID_unicode);
+            name = temp.get();
+        }
+        else if (criteria.artifact) {
+            name = criteria.artifact->getSource();
         }
-        catch (exception& ex) {
-            log.error("metadata intance failed manual validation checking: %s", ex.what());
-            throw MetadataException("Metadata instance failed manual validation checking.");
+        else {
+            return entity;
         }
 
-        // Filter it, which may throw.
-        doFilters(*entity2);
+        if (entity.first)
+            log.info("metadata for (%s) is beyond caching interval, attempting to refresh", name.c_str());
+        else
+            log.info("resolving metadata for (%s)", name.c_str());
 
-        time_t now = time(nullptr);
-        if (entity2->getValidUntil() && entity2->getValidUntilEpoch() < now + 60)
-            throw MetadataException("Metadata was already invalid at the time of retrieval.");
+        cacheEntity(criteria, name, key, entity.first != nullptr);
+    }
 
-        log.info("caching resolved metadata for (%s)", name.c_str());
+    // Whether or not that worked, the lock may have been given up along the way, and the copy found
+    // before may have been replaced or evicted in the meantime, so the index has the only safe answer.
+    return AbstractMetadataProvider::getEntityDescriptor(criteria);
+}
 
-        // Compute the smaller of the validUntil / cacheDuration constraints.
-        time_t cacheExp = (entity2->getValidUntil() ? entity2->getValidUntilEpoch() : SAMLTIME_MAX) - now;
-        if (entity2->getCacheDuration())
-            cacheExp = min(cacheExp, entity2->getCacheDurationEpoch());
-            
-        // Adjust for the delay factor.
-        cacheExp *= m_refreshDelayFactor;
+bool DynamicMetadataProvider::cacheEntity(const Criteria& criteria, const string& name, const xstring& key, bool refresh) const
+{
+    Category& log = Category::getInstance(SAML_LOGCAT".MetadataProvider.Dynamic");
 
-        // Bound by max and min.
-        if (cacheExp > m_maxCacheDuration)
-            cacheExp = m_maxCacheDuration;
-        else if (cacheExp < m_minCacheDuration)
-            cacheExp = m_minCacheDuration;
+    try {
+        time_t now = time(nullptr), cacheExp = 0;
+        auto_ptr<EntityDescriptor> entity2,saved;
+
+        // The first time through, a copy saved by an earlier process will do until it's due for refresh,
+        // and after that, the validator saved with it lets the source answer that it hasn't changed.
+        // It was saved as it came from the source, so it has to get through the filters again.
+        if (!refresh && !m_cacheDirectory.empty()) {
+            time_t savedRefresh = 0;
+            string savedTag;
+            saved.reset(loadEntity(name, savedRefresh, savedTag));
+            if (saved.get()) {
+                try {
+                    doFilters(*saved);
+                    if (savedRefresh > now) {
+                        entity2 = saved;
+                        cacheExp = savedRefresh - now;
+                        log.info("using saved metadata for (%s), next refresh no sooner than %u seconds", name.c_str(), cacheExp);
+                    }
+                    else if (savedTag.empty()) {
+                        saved.reset();
+                    }
+                    if (!savedTag.empty() && (entity2.get() || saved.get())) {
+                        Lock lock(m_cacheLock);
+                        m_cacheTags[key] = savedTag;
+                    }
+                }
+                catch (exception& ex) {
+                    log.warn("ignoring saved metadata for (%s): %s", name.c_str(), ex.what());
+                    saved.reset();
+                }
+            }
+        }
+
+        bool resolved = false;
+        if (!entity2.get()) {
+            // Try resolving it, which can only come back unchanged if there's a saved copy being revalidated.
+            try {
+                entity2.reset(resolve(criteria));
+                resolved = true;
+            }
+            catch (long& ex) {
+                if (ex != HTTPResponse::XMLTOOLING_HTTP_STATUS_NOTMODIFIED || !saved.get())
+                    throw;
+                entity2 = saved;
+                cacheExp = getCacheInterval(*entity2, now);
+                log.info("saved metadata for (%s) unchanged, next refresh no sooner than %u seconds", name.c_str(), cacheExp);
+            }
+        }
 
-        log.info("next refresh of metadata for (%s) no sooner than %u seconds", name.c_str(), cacheExp);
+        if (resolved) {
+            // Verify the entityID.
+            if (criteria.entityID_unicode && !XMLString::equals(criteria.entityID_unicode, entity2->getEntityID())) {
+                throw MetadataException("Metadata instance did not match expected entityID.");
+            }
+            else {
+                auto_ptr_XMLCh temp2(name.c_str());
+                if (!XMLString::equals(temp2.get(), entity2->getEntityID()))
+                    throw MetadataException("Metadata instance did not match expected entityID.");
+            }
+
+            // Preprocess the metadata (even if we schema-validated).
+            try {
+                SchemaValidators.validate(entity2.get());
+            }
+            catch (exception& ex) {
+                log.error("metadata intance failed manual validation checking: %s", ex.what());
+                throw MetadataException("Metadata instance failed manual validation checking.");
+            }
+
+            // Keep it as it came from the source for the next process, which filters it for itself.
+            string raw;
+            if (!m_cacheDirectory.empty())
+                XMLHelper::serialize(entity2->marshall(), raw);
+
+            // Filter it, which may throw.
+            doFilters(*entity2);
+
+            now = time(nullptr);
+            if (entity2->getValidUntil() && entity2->getValidUntilEpoch() < now + 60)
+                throw MetadataException("Metadata was already invalid at the time of retrieval.");
+
+            log.info("caching resolved metadata for (%s)", name.c_str());
+            cacheExp = getCacheInterval(*entity2, now);
+            log.info("next refresh of metadata for (%s) no sooner than %u seconds", name.c_str(), cacheExp);
+
+            // Only now is the validator it came with good for revalidating our copy.
+            string tag;
+            {
+                Lock lock(m_cacheLock);
+                map<xstring,string>::iterator pending = m_pendingTags.find(key);
+                if (pending != m_pendingTags.end()) {
+                    tag = pending->second;
+                    m_pendingTags.erase(pending);
+                }
+                if (!tag.empty())
+                    m_cacheTags[key] = tag;
+                else
+                    m_cacheTags.erase(key);
+            }
+
+            // Save it for the next process to start with, along with the validator.
+            if (!m_cacheDirectory.empty())
+                saveEntity(raw, name, now + cacheExp, tag);
+        }
 
         // Upgrade our lock so we can cache the new metadata.
         m_lock->unlock();
@@ -234,8 +443,13 @@ pair<const EntityDescriptor*,const RoleDescriptor*> DynamicMetadataProvider::get
         // Notify observers.
         emitChangeEvent(*entity2);
 
-        // Record the proper refresh time.
-        m_cacheMap[entity2->getEntityID()] = now + cacheExp;
+        // Record the proper refresh time, which may push older entities out.
+        vector<xstring> evicted;
+        {
+            Lock lock(m_cacheLock);
+            record(entity2->getEntityID(), now + cacheExp, true, evicted);
+        }
+        for_each(evicted.begin(), evicted.end(), boost::bind(&DynamicMetadataProvider::evict, this, _1));
 
         // Make sure we clear out any existing copies, including stale metadata or if somebody snuck in.
         cacheExp = SAMLTIME_MAX;
@@ -247,26 +461,337 @@ pair<const EntityDescriptor*,const RoleDescriptor*> DynamicMetadataProvider::get
         // Downgrade back to a read lock.
         m_lock->unlock();
         m_lock->rdlock();
+        return true;
+    }
+    catch (long& ex) {
+        if (ex == HTTPResponse::XMLTOOLING_HTTP_STATUS_NOTMODIFIED) {
+            // Unchanged, so the copy we have is simply good for another interval.
+            const EntityDescriptor* cached =
+                AbstractMetadataProvider::getEntityDescriptor(Criteria(key.c_str(), nullptr, nullptr, false)).first;
+            if (cached) {
+                time_t now = time(nullptr);
+                time_t cacheExp = getCacheInterval(*cached, now);
+                log.info("metadata for (%s) unchanged, next refresh no sooner than %u seconds", name.c_str(), cacheExp);
+                vector<xstring> evicted;
+                {
+                    Lock lock(m_cacheLock);
+                    record(key, now + cacheExp, true, evicted);
+                }
+                evictAll(evicted);
+                return true;
+            }
+            // Nothing left to revalidate, so the next attempt has to be unconditional.
+            Lock lock(m_cacheLock);
+            m_cacheTags.erase(key);
+        }
+        log.error("error while resolving entityID (%s): HTTP status %ld", name.c_str(), ex);
     }
     catch (exception& e) {
         log.error("error while resolving entityID (%s): %s", name.c_str(), e.what());
-        // This will return entries that are beyond their cache period,
-        // but not beyond their validity unless that criteria option was set.
-        // If it is a cache-expired entry, bump the cache period to prevent retries.
-        if (entity.first)
-            m_cacheMap[entity.first->getEntityID()] = time(nullptr) + m_minCacheDuration;
-        else if (criteria.entityID_unicode)
-            m_cacheMap[criteria.entityID_unicode] = time(nullptr) + m_minCacheDuration;
+    }
+
+    // This will return entries that are beyond their cache period,
+    // but not beyond their validity unless that criteria option was set.
+    // If it is a cache-expired entry, bump the cache period to prevent retries.
+    vector<xstring> evicted;
+    {
+        // If it was resolved and then rejected, the validator it came with goes too, so that
+        // the next attempt doesn't count our copy as current.
+        Lock lock(m_cacheLock);
+        if (m_pendingTags.erase(key))
+            m_cacheTags.erase(key);
+        cachemap_t::const_iterator cit = m_cacheMap.find(key);
+        record(key, time(nullptr) + m_minCacheDuration, cit != m_cacheMap.end() && cit->second.m_found, evicted);
+    }
+    log.warn("next refresh of metadata for (%s) no sooner than %u seconds", name.c_str(), m_minCacheDuration);
+    evictAll(evicted);
+    return false;
+}
+
+time_t DynamicMetadataProvider::getCacheInterval(const EntityDescriptor& entity, time_t now) const
+{
+    // Compute the smaller of the validUntil / cacheDuration constraints.
+    time_t cacheExp = (entity.getValidUntil() ? entity.getValidUntilEpoch() : SAMLTIME_MAX) - now;
+    if (entity.getCacheDuration())
+        cacheExp = min(cacheExp, entity.getCacheDurationEpoch());
+
+    // Adjust for the delay factor.
+    cacheExp *= m_refreshDelayFactor;
+
+    // Bound by max and min.
+    if (cacheExp > m_maxCacheDuration)
+        cacheExp = m_maxCacheDuration;
+    else if (cacheExp < m_minCacheDuration)
+        cacheExp = m_minCacheDuration;
+
+    return cacheExp;
+}
+
+string DynamicMetadataProvider::getCachePath(const string& name) const
+{
+    return m_cacheDirectory + '/' + SecurityHelper::doHash("SHA1", name.c_str(), name.length()) + ".xml";
+}
+
+EntityDescriptor* DynamicMetadataProvider::loadEntity(const string& name, time_t& refresh, string& cacheTag) const
+{
+    string path = getCachePath(name);
+    ifstream in(path.c_str());
+    if (!in)
+        return nullptr;
+
+    // The first line is the refresh time, and the second is the validator it came with, if any.
+    string line;
+    time_t now = time(nullptr);
+    if (!getline(in, line))
+        return nullptr;
+    refresh = strtol(line.c_str(), nullptr, 10);
+    if (!getline(in, cacheTag))
+        return nullptr;
+
+    // A copy that's due for refresh is only any use if the source can be asked whether it's changed.
+    if (refresh <= now && cacheTag.empty())
+        return nullptr;
+
+    Category& log = Category::getInstance(SAML_LOGCAT".MetadataProvider.Dynamic");
+    try {
+        DOMDocument* doc = XMLToolingConfig::getConfig().getParser().parse(in);
+        XercesJanitor<DOMDocument> docjanitor(doc);
+        auto_ptr<XMLObject> xmlObject(XMLObjectBuilder::buildOneFromElement(doc->getDocumentElement(), true));
+        docjanitor.release();
+
+        // It has to be the right entity and still usable before it's worth filtering.
+        EntityDescriptor* entity = dynamic_cast<EntityDescriptor*>(xmlObject.get());
+        auto_ptr_XMLCh temp(name.c_str());
+        if (!entity || !XMLString::equals(temp.get(), entity->getEntityID()))
+            throw MetadataException("Saved metadata did not match expected entityID.");
+        SchemaValidators.validate(entity);
+        if (entity->getValidUntil() && entity->getValidUntilEpoch() < now + 60)
+            throw MetadataException("Saved metadata is no longer valid.");
+        xmlObject.release();
+        return entity;
+    }
+    catch (exception& ex) {
+        log.warn("ignoring saved metadata for (%s): %s", name.c_str(), ex.what());
+    }
+    return nullptr;
+}
+
+void DynamicMetadataProvider::saveEntity(const string& xml, const string& name, time_t refresh, const string& cacheTag) const
+{
+    Category& log = Category::getInstance(SAML_LOGCAT".MetadataProvider.Dynamic");
+    string path = getCachePath(name), temp;
+    SAMLConfig::getConfig().generateRandomBytes(temp, 2);
+    temp = path + '.' + SAMLArtifact::toHex(temp);
+    try {
+        ofstream out(temp.c_str(), ios::binary);
+        out << refresh << '\n' << cacheTag << '\n' << xml;
+        out.close();
+        if (!out)
+            throw IOException("Error writing saved metadata.");
+    }
+    catch (exception& ex) {
+        log.error("unable to save metadata for (%s): %s", name.c_str(), ex.what());
+        remove(temp.c_str());
+        return;
+    }
+
+    remove(path.c_str());
+    if (rename(temp.c_str(), path.c_str()) != 0)
+        log.error("unable to rename saved metadata file for (%s)", name.c_str());
+}
+
+void DynamicMetadataProvider::startRefreshers() const
+{
+    // Called with the cache lock held, once something has been cached.
+    if (!m_initialized || m_shutdown || !m_refreshers.empty())
+        return;
+    Category& log = Category::getInstance(SAML_LOGCAT".MetadataProvider.Dynamic");
+    log.info("starting %u background refresh thread(s)", m_refreshThreads);
+    try {
+        if (!m_refreshWait.get())
+            m_refreshWait.reset(CondWait::create());
+        for (unsigned int i = 0; i < m_refreshThreads; ++i)
+            m_refreshers.push_back(Thread::create(&refresh_fn, const_cast<DynamicMetadataProvider*>(this)));
+    }
+    catch (std::exception& ex) {
+        log.error("unable to start background refresh thread: %s", ex.what());
+    }
+}
+
+bool DynamicMetadataProvider::queueRefresh(const xstring& key) const
+{
+    // When the queue is full, the refresh happens inline as it would without the pool.
+    if (m_refreshers.empty() || m_refreshQueue.size() >= m_maxRefreshQueue)
+        return false;
+    m_resolving.insert(key);
+    m_refreshQueue.push_back(key);
+    m_refreshWait->signal();
+    return true;
+}
+
+void DynamicMetadataProvider::scanForRefresh() const
+{
+    // Failed lookups are left to be retried on demand, so only cached entities are refreshed,
+    // and only those still in use, so the rest just age out.
+    time_t now = time(nullptr);
+    for (cachemap_t::const_iterator i = m_cacheMap.begin(); i != m_cacheMap.end(); ++i) {
+        if (i->second.m_found && i->second.m_accessed && i->second.m_refresh < now && !m_resolving.count(i->first)) {
+            if (!queueRefresh(i->first))
+                break;
+        }
+    }
+}
+
+void DynamicMetadataProvider::touch(cacheentry_t& entry) const
+{
+    lrulist_t& lru = entry.m_found ? m_entityLRU : m_negativeLRU;
+    lru.splice(lru.begin(), lru, entry.m_lru);
+    entry.m_accessed = true;
+}
+
+void DynamicMetadataProvider::record(const xstring& key, time_t refresh, bool found, vector<xstring>& evicted) const
+{
+    if (found && m_refreshThreads > 0 && m_refreshers.empty())
+        startRefreshers();
+
+    cachemap_t::iterator i = m_cacheMap.find(key);
+    if (i == m_cacheMap.end()) {
+        lrulist_t& lru = found ? m_entityLRU : m_negativeLRU;
+        lru.push_front(key);
+        cacheentry_t& entry = m_cacheMap[key];
+        entry.m_refresh = refresh;
+        entry.m_found = found;
+        entry.m_accessed = false;
+        entry.m_lru = lru.begin();
+        unsigned int& count = found ? m_entityCount : m_negativeCount;
+        ++count;
+    }
+    else if (i->second.m_found != found) {
+        if (found) {
+            m_entityLRU.splice(m_entityLRU.begin(), m_negativeLRU, i->second.m_lru);
+            --m_negativeCount;
+            ++m_entityCount;
+        }
         else {
-            auto_ptr_XMLCh widetemp(name.c_str());
-            m_cacheMap[widetemp.get()] = time(nullptr) + m_minCacheDuration;
+            m_negativeLRU.splice(m_negativeLRU.begin(), m_entityLRU, i->second.m_lru);
+            --m_entityCount;
+            ++m_negativeCount;
         }
-        log.warn("next refresh of metadata for (%s) no sooner than %u seconds", name.c_str(), m_minCacheDuration);
-        return entity;
+        i->second.m_refresh = refresh;
+        i->second.m_found = found;
+        i->second.m_accessed = false;
+    }
+    else {
+        // Only lookups count as use, which a background refresh isn't.
+        i->second.m_refresh = refresh;
+        i->second.m_accessed = false;
+    }
+
+    // Failed lookups are simply forgotten.
+    while (m_maxNegativeEntries && m_negativeCount > m_maxNegativeEntries) {
+        m_cacheMap.erase(m_negativeLRU.back());
+        m_cacheTags.erase(m_negativeLRU.back());
+        m_negativeLRU.pop_back();
+        --m_negativeCount;
+    }
+
+    // Cached entities also have to come out of the index, which is left to the caller.
+    lrulist_t::iterator victim = m_entityLRU.end();
+    while (m_maxEntities && m_entityCount > m_maxEntities && victim != m_entityLRU.begin()) {
+        --victim;
+        if (*victim == key || m_resolving.count(*victim))
+            continue;
+        evicted.push_back(*victim);
+        m_cacheMap.erase(*victim);
+        m_cacheTags.erase(*victim);
+        victim = m_entityLRU.erase(victim);
+        --m_entityCount;
     }
+}
 
-    // Rinse and repeat.
-    return getEntityDescriptor(criteria);
+void DynamicMetadataProvider::evict(const xstring& key) const
+{
+    // Called with the write lock held.
+    const EntityDescriptor* entity =
+        AbstractMetadataProvider::getEntityDescriptor(Criteria(key.c_str(), nullptr, nullptr, false)).first;
+    if (entity) {
+        auto_ptr_char id(key.c_str());
+        Category::getInstance(SAML_LOGCAT".MetadataProvider.Dynamic").info(
+            "evicting least recently used metadata for (%s)", id.get()
+            );
+        emitChangeEvent(*entity);
+        unindexEntity(entity);
+        delete entity;
+    }
+}
+
+void DynamicMetadataProvider::evictAll(const vector<xstring>& evicted) const
+{
+    // Called with the read lock held, which has to be upgraded to change the index.
+    if (evicted.empty())
+        return;
+    m_lock->unlock();
+    m_lock->wrlock();
+    for_each(evicted.begin(), evicted.end(), boost::bind(&DynamicMetadataProvider::evict, this, _1));
+    m_lock->unlock();
+    m_lock->rdlock();
+}
+
+void* DynamicMetadataProvider::refresh_fn(void* pv)
+{
+    const DynamicMetadataProvider* provider = reinterpret_cast<const DynamicMetadataProvider*>(pv);
+    Category& log = Category::getInstance(SAML_LOGCAT".MetadataProvider.Dynamic");
+
+#ifndef WIN32
+    // First, let's block all signals
+    Thread::mask_all_signals();
+#endif
+
+    // Look for entities due for a refresh at least as often as the shortest caching interval,
+    // but no more than once a second.
+    int scanInterval = min(provider->m_minCacheDuration, 60);
+    if (scanInterval < 1)
+        scanInterval = 1;
+
+    provider->m_cacheLock->lock();
+    while (!provider->m_shutdown) {
+        if (provider->m_refreshQueue.empty()) {
+            if (time(nullptr) >= provider->m_lastScan + scanInterval) {
+                provider->m_lastScan = time(nullptr);
+                provider->scanForRefresh();
+            }
+            else {
+                provider->m_refreshWait->timedwait(provider->m_cacheLock.get(), scanInterval);
+            }
+            continue;
+        }
+
+        xstring key = provider->m_refreshQueue.front();
+        provider->m_refreshQueue.pop_front();
+        ++provider->m_activeRefreshes;
+        provider->m_cacheLock->unlock();
+
+        bool refreshed = false;
+        try {
+            // The lookup was marked as in progress when it was queued.
+            resolving_t resolving(*provider->m_cacheLock, *provider->m_resolved, provider->m_resolving, key);
+            provider->m_lock->rdlock();
+            SharedLock locker(provider->m_lock.get(), false);
+            auto_ptr_char name(key.c_str());
+            log.info("refreshing metadata for (%s) in the background", name.get());
+            refreshed = provider->cacheEntity(Criteria(key.c_str(), nullptr, nullptr, false), name.get(), key, true);
+        }
+        catch (std::exception& ex) {
+            log.error("unexpected error during background refresh: %s", ex.what());
+        }
+
+        provider->m_cacheLock->lock();
+        --provider->m_activeRefreshes;
+        if (!refreshed)
+            ++provider->m_failedRefreshes;
+    }
+    provider->m_cacheLock->unlock();
+    return nullptr;
 }
 
 EntityDescriptor* DynamicMetadataProvider::resolve(const Criteria& criteria) const
@@ -286,13 +811,29 @@ EntityDescriptor* DynamicMetadataProvider::resolve(const Criteria& criteria) con
     try {
         DOMDocument* doc=nullptr;
         auto_ptr_XMLCh widenit(name.c_str());
-        URLInputSource src(widenit.get());
+
+        // Revalidate against whatever the server last told us about the copy we hold.
+        string cacheTag;
+        {
+            Lock lock(m_cacheLock);
+            map<xstring,string>::const_iterator tag = m_cacheTags.find(widenit.get());
+            if (tag != m_cacheTags.end())
+                cacheTag = tag->second;
+        }
+
+        URLInputSource src(widenit.get(), nullptr, &cacheTag);
         Wrapper4InputSource dsrc(&src,false);
         if (m_validate)
             doc=XMLToolingConfig::getConfig().getValidatingParser().parse(dsrc);
         else
             doc=XMLToolingConfig::getConfig().getParser().parse(dsrc);
 
+        // It's up to the caller whether the entity, and so its validator, is kept.
+        {
+            Lock lock(m_cacheLock);
+            m_pendingTags[widenit.get()] = cacheTag;
+        }
+
         // Wrap the document for now.
         XercesJanitor<DOMDocument> docjanitor(doc);
 
@@ -28,12 +28,11 @@
 #include "saml2/metadata/EntityMatcher.h"
 #include "saml2/metadata/Metadata.h"
 
-#include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/iterator/indirect_iterator.hpp>
-#include <boost/lambda/bind.hpp>
 #include <boost/lambda/casts.hpp>
 #include <boost/lambda/lambda.hpp>
+#include <xercesc/util/XMLChar.hpp>
 #include <xercesc/util/XMLUniDefs.hpp>
 #include <xercesc/util/regx/RegularExpression.hpp>
 #include <xmltooling/logging.h>
@@ -59,10 +58,26 @@ namespace opensaml {
             bool matches(const EntityDescriptor& entity) const;
 
         private:
-            bool _matches(const EntityAttributes*, const Attribute*) const;
+            // A tag value, with its regex compiled up front if it is one.
+            struct SAML_DLLLOCAL tagvalue_t {
+                tagvalue_t(const XMLCh* text) : m_text(text ? text : &chNull), m_null(text == nullptr) {}
+                xstring m_text;
+                bool m_null;
+                boost::shared_ptr<RegularExpression> m_regex;
+            };
+
+            // A tag reduced to what the comparisons need; an empty format matches any.
+            struct SAML_DLLLOCAL tag_t {
+                xstring m_name,m_format;
+                vector<tagvalue_t> m_values;
+            };
+
+            void addTag(const Attribute& tag);
+            bool _matches(const EntityAttributes*, const tag_t&) const;
+            bool _matches(const tagvalue_t&, const XMLCh*) const;
 
             bool m_trimTags;
-            vector< boost::shared_ptr<Attribute> > m_tags;
+            vector<tag_t> m_tags;
             Category& m_log;
         };
 
@@ -101,13 +116,15 @@ EntityAttributesEntityMatcher::EntityAttributesEntityMatcher(const DOMElement* e
         }
         np->getAttributeValues().push_back(nval.get());
         nval.release();
-        m_tags.push_back(np);
+        addTag(*np);
     }
 
     DOMElement* child = XMLHelper::getFirstChildElement(e, samlconstants::SAML20_NS, Attribute::LOCAL_NAME);
     while (child) {
         boost::shared_ptr<XMLObject> obj(AttributeBuilder::buildOneFromElement(child));
-        m_tags.push_back(boost::dynamic_pointer_cast<Attribute>(obj));
+        const Attribute* tag = dynamic_cast<const Attribute*>(obj.get());
+        if (tag)
+            addTag(*tag);
         child = XMLHelper::getNextSiblingElement(child, samlconstants::SAML20_NS, Attribute::LOCAL_NAME);
     }
 
@@ -115,6 +132,39 @@ EntityAttributesEntityMatcher::EntityAttributesEntityMatcher(const DOMElement* e
         throw XMLToolingException("EntityAttributes EntityMatcher requires at least one saml2:Attribute to match.");
 }
 
+void EntityAttributesEntityMatcher::addTag(const Attribute& tag)
+{
+    m_tags.push_back(tag_t());
+    tag_t& t = m_tags.back();
+    if (tag.getName())
+        t.m_name = tag.getName();
+    if (tag.getNameFormat() && !XMLString::equals(tag.getNameFormat(), Attribute::UNSPECIFIED))
+        t.m_format = tag.getNameFormat();
+
+    xmltooling::QName regexQName(nullptr, regex);
+    const vector<XMLObject*>& tagvals = tag.getAttributeValues();
+    for (indirect_iterator<vector<XMLObject*>::const_iterator> tagval = make_indirect_iterator(tagvals.begin());
+            tagval != make_indirect_iterator(tagvals.end()); ++tagval) {
+        t.m_values.push_back(tagvalue_t(tagval->getDOM() ? tagval->getDOM()->getTextContent() : tagval->getTextContent()));
+        tagvalue_t& val = t.m_values.back();
+
+        // Check for a regex flag, and compile it now rather than on every match.
+        const AttributeExtensibleXMLObject* ext = dynamic_cast<const AttributeExtensibleXMLObject*>(&(*tagval));
+        if (ext && !val.m_null) {
+            const XMLCh* reflag = ext->getAttribute(regexQName);
+            if (reflag && (*reflag == chDigit_1 || *reflag == chLatin_t)) {
+                try {
+                    val.m_regex.reset(new RegularExpression(val.m_text.c_str()));
+                }
+                catch (XMLException& ex) {
+                    auto_ptr_char msg(ex.getMessage());
+                    m_log.error(msg.get());
+                }
+            }
+        }
+    }
+}
+
 bool EntityAttributesEntityMatcher::matches(const EntityDescriptor& entity) const
 {
     bool extFound = false;
@@ -127,10 +177,9 @@ bool EntityAttributesEntityMatcher::matches(const EntityDescriptor& entity) cons
         if (xo) {
             extFound = true;
             // If we find a matching tag, we win. Each tag is treated in OR fashion.
-            if (find_if(m_tags.begin(), m_tags.end(),
-                lambda::bind(&EntityAttributesEntityMatcher::_matches, this, dynamic_cast<const EntityAttributes*>(xo),
-                    lambda::bind(&boost::shared_ptr<Attribute>::get, _1))) != m_tags.end()) {
-                return true;
+            for (vector<tag_t>::const_iterator tag = m_tags.begin(); tag != m_tags.end(); ++tag) {
+                if (_matches(dynamic_cast<const EntityAttributes*>(xo), *tag))
+                    return true;
             }
         }
     }
@@ -144,10 +193,9 @@ bool EntityAttributesEntityMatcher::matches(const EntityDescriptor& entity) cons
             if (xo) {
                 extFound = true;
                 // If we find a matching tag, we win. Each tag is treated in OR fashion.
-                if (find_if(m_tags.begin(), m_tags.end(),
-                    lambda::bind(&EntityAttributesEntityMatcher::_matches, this, dynamic_cast<const EntityAttributes*>(xo),
-                        lambda::bind(&boost::shared_ptr<Attribute>::get, _1))) != m_tags.end()) {
-                    return true;
+                for (vector<tag_t>::const_iterator tag = m_tags.begin(); tag != m_tags.end(); ++tag) {
+                    if (_matches(dynamic_cast<const EntityAttributes*>(xo), *tag))
+                        return true;
                 }
             }
         }
@@ -162,85 +210,73 @@ bool EntityAttributesEntityMatcher::matches(const EntityDescriptor& entity) cons
     return false;
 }
 
-bool EntityAttributesEntityMatcher::_matches(const EntityAttributes* ea, const Attribute* tag) const
+bool EntityAttributesEntityMatcher::_matches(const EntityAttributes* ea, const tag_t& tag) const
 {
     const vector<Attribute*>& attrs = ea->getAttributes();
-    const vector<XMLObject*>& tagvals = tag->getAttributeValues();
-    if (!attrs.empty() && !tagvals.empty()) {
+    if (!attrs.empty() && !tag.m_values.empty()) {
         // Track whether we've found every tag value.
-        vector<bool> flags(tagvals.size());
-
-        // Holds the active regex, if any.
-        scoped_ptr<RegularExpression> re;
-        xmltooling::QName regexQName(nullptr, regex);
+        vector<bool> flags(tag.m_values.size());
+        vector<bool>::size_type remaining = flags.size();
 
         // Check each attribute/tag in the candidate.
         for (indirect_iterator<vector<Attribute*>::const_iterator> a = make_indirect_iterator(attrs.begin());
                 a != make_indirect_iterator(attrs.end()); ++a) {
             // Compare Name and NameFormat for a matching tag.
-            if (XMLString::equals(a->getName(), tag->getName()) &&
-                (!tag->getNameFormat() || XMLString::equals(tag->getNameFormat(), Attribute::UNSPECIFIED) ||
-                    XMLString::equals(tag->getNameFormat(), a->getNameFormat()))) {
-
-                // Check each tag value's simple content for a match.
-                for (vector<XMLObject*>::size_type tagindex = 0; tagindex < tagvals.size(); ++tagindex) {
-                    const XMLObject* tagval = tagvals[tagindex];
-                    const XMLCh* tagvalstr = (tagval->getDOM()) ? tagval->getDOM()->getTextContent() : tagval->getTextContent();
-                    re.reset();
-
-                    // Check for a regex flag.
-                    if (dynamic_cast<const AttributeExtensibleXMLObject*>(tagval)) {
-                        const XMLCh* reflag = dynamic_cast<const AttributeExtensibleXMLObject*>(tagval)->getAttribute(regexQName);
-                        if (reflag && (*reflag == chDigit_1 || *reflag == chLatin_t)) {
-                            try {
-                                re.reset(new RegularExpression(tagvalstr));
-                            }
-                            catch (XMLException& ex) {
-                                auto_ptr_char msg(ex.getMessage());
-                                m_log.error(msg.get());
-                            }
-                        }
-                    }
-                    
-                    const vector<XMLObject*>& cvals = const_cast<const Attribute&>(*a).getAttributeValues();
-                    for (indirect_iterator<vector<XMLObject*>::const_iterator> cval = make_indirect_iterator(cvals.begin());
-                            cval != make_indirect_iterator(cvals.end()); ++cval) {
-                        const XMLCh* cvalstr = cval->getDOM() ? cval->getDOM()->getTextContent() : cval->getTextContent();
-                        if (tagvalstr && cvalstr) {
-                            if (re) {
-                                try {
-                                    if (re->matches(cvalstr)) {
-                                        flags[tagindex] = true;
-                                        break;
-                                    }
-                                }
-                                catch (XMLException& ex) {
-                                    auto_ptr_char msg(ex.getMessage());
-                                    m_log.error(msg.get());
-                                }
-                            }
-                            else if (XMLString::equals(tagvalstr, cvalstr)) {
-                                flags[tagindex] = true;
-                                break;
-                            }
-                            else if (m_trimTags) {
-                                XMLCh* dup = XMLString::replicate(cvalstr);
-                                XMLString::trim(dup);
-                                if (XMLString::equals(tagvalstr, dup)) {
-                                    XMLString::release(&dup);
-                                    flags[tagindex] = true;
-                                    break;
-                                }
-                                XMLString::release(&dup);
-                            }
-                        }
+            if (!XMLString::equals(a->getName(), tag.m_name.c_str()) ||
+                    (!tag.m_format.empty() && !XMLString::equals(tag.m_format.c_str(), a->getNameFormat())))
+                continue;
+
+            // Check each tag value not yet found against the candidate's simple content.
+            const vector<XMLObject*>& cvals = const_cast<const Attribute&>(*a).getAttributeValues();
+            for (vector<tagvalue_t>::size_type tagindex = 0; tagindex < tag.m_values.size(); ++tagindex) {
+                if (flags[tagindex])
+                    continue;
+                for (indirect_iterator<vector<XMLObject*>::const_iterator> cval = make_indirect_iterator(cvals.begin());
+                        cval != make_indirect_iterator(cvals.end()); ++cval) {
+                    if (_matches(tag.m_values[tagindex], cval->getDOM() ? cval->getDOM()->getTextContent() : cval->getTextContent())) {
+                        flags[tagindex] = true;
+                        --remaining;
+                        break;
                     }
                 }
             }
+
+            if (remaining == 0)
+                return true;
         }
+    }
+    return false;
+}
+
+bool EntityAttributesEntityMatcher::_matches(const tagvalue_t& tagval, const XMLCh* cvalstr) const
+{
+    if (tagval.m_null || !cvalstr)
+        return false;
+
+    if (tagval.m_regex) {
+        try {
+            return tagval.m_regex->matches(cvalstr);
+        }
+        catch (XMLException& ex) {
+            auto_ptr_char msg(ex.getMessage());
+            m_log.error(msg.get());
+        }
+        return false;
+    }
+
+    if (XMLString::equals(tagval.m_text.c_str(), cvalstr))
+        return true;
 
-        if (find(flags.begin(), flags.end(), false) == flags.end())
-            return true;
+    if (m_trimTags) {
+        // Compare against the candidate with surrounding whitespace skipped, without copying it.
+        const XMLCh* start = cvalstr;
+        while (*start && XMLChar1_0::isWhitespace(*start))
+            ++start;
+        const XMLCh* end = start + XMLString::stringLen(start);
+        while (end > start && XMLChar1_0::isWhitespace(*(end - 1)))
+            --end;
+        return tagval.m_text.length() == static_cast<xstring::size_type>(end - start) &&
+            tagval.m_text.compare(0, xstring::npos, start, end - start) == 0;
     }
     return false;
 }
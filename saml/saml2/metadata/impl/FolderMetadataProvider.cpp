@@ -60,6 +60,7 @@ namespace opensaml {
         static const XMLCh _MetadataProvider[] =    UNICODE_LITERAL_16(M,e,t,a,d,a,t,a,P,r,o,v,i,d,e,r);
         static const XMLCh discoveryFeed[] =        UNICODE_LITERAL_13(d,i,s,c,o,v,e,r,y,F,e,e,d);
         static const XMLCh dropDOM[] =              UNICODE_LITERAL_7(d,r,o,p,D,O,M);
+        static const XMLCh initThreads[] =          UNICODE_LITERAL_11(i,n,i,t,T,h,r,e,a,d,s);
         static const XMLCh legacyOrgNames[] =       UNICODE_LITERAL_14(l,e,g,a,c,y,O,r,g,N,a,m,e,s);
         static const XMLCh path[] =                 UNICODE_LITERAL_4(p,a,t,h);
         static const XMLCh precedence[] =           UNICODE_LITERAL_10(p,r,e,c,e,d,e,n,c,e);
@@ -81,11 +82,13 @@ namespace opensaml {
             string fullname, loc(p.get());
             XMLToolingConfig::getConfig().getPathResolver()->resolve(loc, PathResolver::XMLTOOLING_CFG_FILE);
 
-            // First we build a new root element of the right type, and copy in the precedence setting.
+            // First we build a new root element of the right type, and copy in the chaining settings.
             DOMElement* root = e->getOwnerDocument()->createElementNS(nullptr, _MetadataProvider);
             root->setAttributeNS(nullptr, _type, Chaining);
             if (e->hasAttributeNS(nullptr, precedence))
                 root->setAttributeNS(nullptr, precedence, e->getAttributeNS(nullptr, precedence));
+            if (e->hasAttributeNS(nullptr, initThreads))
+                root->setAttributeNS(nullptr, initThreads, e->getAttributeNS(nullptr, initThreads));
 
             Category& log = Category::getInstance(SAML_LOGCAT".Metadata.Folder");
             log.info("loading metadata files from folder (%s)", loc.c_str());
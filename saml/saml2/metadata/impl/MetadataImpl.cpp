@@ -26,6 +26,7 @@
 
 #include "internal.h"
 #include "exceptions.h"
+#include "saml2/metadata/EndpointManager.h"
 #include "saml2/metadata/Metadata.h"
 #include "signature/ContentReference.h"
 
@@ -47,6 +48,7 @@
 #include <boost/lambda/bind.hpp>
 #include <boost/lambda/if.hpp>
 #include <boost/lambda/lambda.hpp>
+#include <xercesc/util/XMLChar.hpp>
 #include <xercesc/util/XMLUniDefs.hpp>
 #include <xsec/framework/XSECDefs.hpp>
 
@@ -651,6 +653,7 @@ namespace opensaml {
         {
             void init() {
                 m_Index=nullptr;
+                m_IndexValue=make_pair(false,0);
                 m_isDefault=XML_BOOL_NULL;
             }
 
@@ -679,7 +682,39 @@ namespace opensaml {
             }
 
             IMPL_XMLOBJECT_CLONE_EX(IndexedEndpointType);
-            IMPL_INTEGER_ATTRIB(Index);
+
+            //IMPL_INTEGER_ATTRIB(Index);
+            // Need customized setter so endpoint lookups don't parse the index on every call.
+        protected:
+            XMLCh* m_Index;
+            pair<bool,int> m_IndexValue;
+        public:
+            pair<bool,int> getIndex() const {
+                return m_IndexValue;
+            }
+
+            void setIndex(const XMLCh* Index) {
+                m_Index = prepareForAssignment(m_Index,Index);
+                if (m_Index) {
+                    try {
+                        m_IndexValue = make_pair(true, XMLString::parseInt(m_Index));
+                    }
+                    catch (...) {
+                        m_IndexValue = make_pair(true, 0);
+                    }
+                }
+                else {
+                    m_IndexValue = make_pair(false, 0);
+                }
+            }
+
+            void setIndex(int Index) {
+                char buf[64];
+                sprintf(buf,"%d",Index);
+                auto_ptr_XMLCh wide(buf);
+                setIndex(wide.get());
+            }
+
             IMPL_BOOLEAN_ATTRIB(isDefault);
 
             void setAttribute(const xmltooling::QName& qualifiedName, const XMLCh* value, bool ID=false) {
@@ -834,6 +869,20 @@ namespace opensaml {
             IMPL_XMLOBJECT_CLONE_EX(AttributeService);
         };
 
+        // Protocols common enough to be tracked as bits rather than compared as strings.
+        static const XMLCh* const g_knownProtocols[] = { SAML20P_NS, SAML11_PROTOCOL_ENUM, SAML10_PROTOCOL_ENUM };
+
+        static unsigned int protocolBit(const XMLCh* protocol, xsecsize_t len)
+        {
+            for (unsigned int i = 0; i < sizeof(g_knownProtocols)/sizeof(const XMLCh*); ++i) {
+                if (protocol == g_knownProtocols[i] ||
+                        (XMLString::stringLen(g_knownProtocols[i]) == len &&
+                            0 == XMLString::compareNString(protocol, g_knownProtocols[i], len)))
+                    return 1 << i;
+            }
+            return 0;
+        }
+
         class SAML_DLLLOCAL RoleDescriptorImpl : public virtual RoleDescriptor,
             public virtual SignableObject,
             public AbstractComplexElement,
@@ -845,6 +894,7 @@ namespace opensaml {
             void init() {
                 m_ID=m_ProtocolSupportEnumeration=m_ErrorURL=nullptr;
                 m_ValidUntil=m_CacheDuration=nullptr;
+                m_protocolBits=0;
                 m_children.push_back(nullptr);
                 m_children.push_back(nullptr);
                 m_children.push_back(nullptr);
@@ -923,8 +973,42 @@ namespace opensaml {
                 return dynamic_cast<RoleDescriptor*>(clone());
             }
 
+            //IMPL_STRING_ATTRIB(ProtocolSupportEnumeration);
+            // Need customized setter to parse the list once instead of on every hasSupport call.
+        protected:
+            XMLCh* m_ProtocolSupportEnumeration;
+            unsigned int m_protocolBits;
+            vector<xstring> m_otherProtocols;
+        public:
+            const XMLCh* getProtocolSupportEnumeration() const {
+                return m_ProtocolSupportEnumeration;
+            }
+
+            void setProtocolSupportEnumeration(const XMLCh* ProtocolSupportEnumeration) {
+                m_ProtocolSupportEnumeration = prepareForAssignment(m_ProtocolSupportEnumeration,ProtocolSupportEnumeration);
+                m_protocolBits = 0;
+                m_otherProtocols.clear();
+                if (!m_ProtocolSupportEnumeration)
+                    return;
+                const XMLCh* token = m_ProtocolSupportEnumeration;
+                while (*token) {
+                    while (*token && XMLChar1_0::isWhitespace(*token))
+                        ++token;
+                    const XMLCh* end = token;
+                    while (*end && !XMLChar1_0::isWhitespace(*end))
+                        ++end;
+                    if (end > token) {
+                        unsigned int bit = protocolBit(token, end - token);
+                        if (bit)
+                            m_protocolBits |= bit;
+                        else
+                            m_otherProtocols.push_back(xstring(token, end - token));
+                    }
+                    token = end;
+                }
+            }
+
             IMPL_ID_ATTRIB_EX(ID,ID,nullptr);
-            IMPL_STRING_ATTRIB(ProtocolSupportEnumeration);
             IMPL_STRING_ATTRIB(ErrorURL);
             IMPL_DATETIME_ATTRIB(ValidUntil,SAMLTIME_MAX);
             IMPL_DURATION_ATTRIB(CacheDuration,0);
@@ -933,36 +1017,42 @@ namespace opensaml {
             IMPL_TYPED_CHILD(Organization);
             IMPL_TYPED_CHILDREN(ContactPerson,m_pos_ContactPerson);
 
+        protected:
+            // Endpoint lookup tables, keyed by the collection they were built from.
+            map<const void*,EndpointTable> m_endpointTables;
+
+            template <class _Tx> void buildEndpointTable(const vector<_Tx*>& endpoints) {
+                if (!endpoints.empty())
+                    m_endpointTables[&endpoints].build(endpoints);
+            }
+
+            template <class _Tx> void buildIndexedEndpointTable(const vector<_Tx*>& endpoints) {
+                if (!endpoints.empty())
+                    m_endpointTables[&endpoints].buildIndexed(endpoints);
+            }
+        public:
+            void indexEndpoints() {
+                m_endpointTables.clear();
+            }
+
+            const EndpointTable* getEndpointTable(const void* endpoints) const {
+                map<const void*,EndpointTable>::const_iterator i = m_endpointTables.find(endpoints);
+                return (i != m_endpointTables.end()) ? &(i->second) : nullptr;
+            }
+
             bool hasSupport(const XMLCh* protocol) const {
                 if (!protocol || !*protocol)
                     return true;
-                if (m_ProtocolSupportEnumeration) {
-                    // Look for first character.
-                    xsecsize_t len=XMLString::stringLen(protocol);
-                    xsecsize_t pos=0;
-                    int index=XMLString::indexOf(m_ProtocolSupportEnumeration,protocol[0],pos);
-                    while (index>=0) {
-                        // Only possible match is if it's the first character or a space comes before it.
-                        if (index==0 || m_ProtocolSupportEnumeration[index-1]==chSpace) {
-                            // See if rest of protocol string is present.
-                            if (0==XMLString::compareNString(m_ProtocolSupportEnumeration+index+1,protocol+1,len-1)) {
-                                // Only possible match is if it's the last character or a space comes after it.
-                                if (m_ProtocolSupportEnumeration[index+len]==chNull || m_ProtocolSupportEnumeration[index+len]==chSpace)
-                                    return true;
-                                else
-                                    pos=index+len;
-                            }
-                            else {
-                                // Move past last search and start again.
-                                pos=index+1;
-                            }
-                        }
-                        else {
-                            // Move past last search and start again.
-                            pos=index+1;
-                        }
-                        index=XMLString::indexOf(m_ProtocolSupportEnumeration,protocol[0],pos);
-                    }
+                for (unsigned int i = 0; i < sizeof(g_knownProtocols)/sizeof(const XMLCh*); ++i) {
+                    if (protocol == g_knownProtocols[i])
+                        return (m_protocolBits & (1 << i)) != 0;
+                }
+                unsigned int bit = protocolBit(protocol, XMLString::stringLen(protocol));
+                if (bit)
+                    return (m_protocolBits & bit) != 0;
+                for (vector<xstring>::const_iterator i = m_otherProtocols.begin(); i != m_otherProtocols.end(); ++i) {
+                    if (*i == protocol)
+                        return true;
                 }
                 return false;
             }
@@ -1127,6 +1217,13 @@ namespace opensaml {
             IMPL_TYPED_CHILDREN(ManageNameIDService,m_pos_ManageNameIDService);
             IMPL_TYPED_CHILDREN(NameIDFormat,m_pos_NameIDFormat);
 
+            void indexEndpoints() {
+                RoleDescriptorImpl::indexEndpoints();
+                buildIndexedEndpointTable(m_ArtifactResolutionServices);
+                buildEndpointTable(m_SingleLogoutServices);
+                buildEndpointTable(m_ManageNameIDServices);
+            }
+
         protected:
             void processChildElement(XMLObject* childXMLObject, const DOMElement* root) {
                 PROC_TYPED_CHILDREN(ArtifactResolutionService,SAML20MD_NS,false);
@@ -1190,6 +1287,13 @@ namespace opensaml {
             IMPL_TYPED_CHILDREN(AttributeProfile,m_pos_AttributeProfile);
             IMPL_TYPED_FOREIGN_CHILDREN(Attribute,saml2,m_children.end());
 
+            void indexEndpoints() {
+                SSODescriptorTypeImpl::indexEndpoints();
+                buildEndpointTable(m_SingleSignOnServices);
+                buildEndpointTable(m_NameIDMappingServices);
+                buildEndpointTable(m_AssertionIDRequestServices);
+            }
+
             void setAttribute(const xmltooling::QName& qualifiedName, const XMLCh* value, bool ID=false) {
                 if (!qualifiedName.hasNamespaceURI()) {
                     if (XMLString::equals(qualifiedName.getLocalPart(),WANTAUTHNREQUESTSSIGNED_ATTRIB_NAME)) {
@@ -1402,6 +1506,11 @@ namespace opensaml {
             IMPL_TYPED_CHILDREN(AssertionConsumerService,m_pos_AssertionConsumerService);
             IMPL_TYPED_CHILDREN(AttributeConsumingService,m_children.end());
 
+            void indexEndpoints() {
+                SSODescriptorTypeImpl::indexEndpoints();
+                buildIndexedEndpointTable(m_AssertionConsumerServices);
+            }
+
             void setAttribute(const xmltooling::QName& qualifiedName, const XMLCh* value, bool ID=false) {
                 if (!qualifiedName.hasNamespaceURI()) {
                     if (XMLString::equals(qualifiedName.getLocalPart(),AUTHNREQUESTSSIGNED_ATTRIB_NAME)) {
@@ -1468,6 +1577,12 @@ namespace opensaml {
             IMPL_TYPED_CHILDREN(AssertionIDRequestService,m_pos_AssertionIDRequestService);
             IMPL_TYPED_CHILDREN(NameIDFormat,m_children.end());
 
+            void indexEndpoints() {
+                RoleDescriptorImpl::indexEndpoints();
+                buildEndpointTable(m_AuthnQueryServices);
+                buildEndpointTable(m_AssertionIDRequestServices);
+            }
+
         protected:
             void processChildElement(XMLObject* childXMLObject, const DOMElement* root) {
                 PROC_TYPED_CHILDREN(AuthnQueryService,SAML20MD_NS,false);
@@ -1515,6 +1630,12 @@ namespace opensaml {
             IMPL_TYPED_CHILDREN(AssertionIDRequestService,m_pos_AssertionIDRequestService);
             IMPL_TYPED_CHILDREN(NameIDFormat,m_children.end());
 
+            void indexEndpoints() {
+                RoleDescriptorImpl::indexEndpoints();
+                buildEndpointTable(m_AuthzServices);
+                buildEndpointTable(m_AssertionIDRequestServices);
+            }
+
         protected:
             void processChildElement(XMLObject* childXMLObject, const DOMElement* root) {
                 PROC_TYPED_CHILDREN(AuthzService,SAML20MD_NS,false);
@@ -1574,6 +1695,12 @@ namespace opensaml {
             IMPL_TYPED_CHILDREN(AttributeProfile,m_pos_AttributeProfile);
             IMPL_TYPED_FOREIGN_CHILDREN(Attribute,saml2,m_children.end());
 
+            void indexEndpoints() {
+                RoleDescriptorImpl::indexEndpoints();
+                buildEndpointTable(m_AttributeServices);
+                buildEndpointTable(m_AssertionIDRequestServices);
+            }
+
         protected:
             void processChildElement(XMLObject* childXMLObject, const DOMElement* root) {
                 PROC_TYPED_CHILDREN(AttributeService,SAML20MD_NS,false);
@@ -2682,6 +2809,15 @@ xmltooling::XMLObject* RoleDescriptorBuilder::buildObject(
     return new RoleDescriptorTypeImpl(nsURI,localName,prefix,schemaType);
 }
 
+void RoleDescriptor::indexEndpoints()
+{
+}
+
+const EndpointTable* RoleDescriptor::getEndpointTable(const void*) const
+{
+    return nullptr;
+}
+
 const DigestMethod* RoleDescriptor::getDigestMethod() const
 {
     bool roleLevel = false;
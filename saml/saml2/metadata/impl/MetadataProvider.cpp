@@ -25,6 +25,7 @@
  */
 
 #include "internal.h"
+#include "saml2/metadata/Metadata.h"
 #include "saml2/metadata/MetadataFilter.h"
 #include "saml2/metadata/MetadataProvider.h"
 
@@ -57,6 +58,26 @@ namespace opensaml {
         SAML_DLLLOCAL PluginManager<MetadataFilter,string,const DOMElement*>::Factory RequireValidUntilMetadataFilterFactory;
         SAML_DLLLOCAL PluginManager<MetadataFilter,string,const DOMElement*>::Factory EntityRoleMetadataFilterFactory;
         SAML_DLLLOCAL PluginManager<MetadataFilter,string,const DOMElement*>::Factory EntityAttributesMetadataFilterFactory;
+
+        // Shared by the Blacklist and Whitelist filters. Each run of flagged entities goes in a single range
+        // erase, working back from the end so the positions yet to be visited stay put, which saves shifting
+        // the rest of the vector once per entity. Each entity is still found and unlinked from the group's
+        // list of ordered children on its own, so that part remains linear in the group's size per removal.
+        SAML_DLLLOCAL void removeEntities(EntitiesDescriptor& group, const vector<bool>& removed)
+        {
+            VectorOf(EntityDescriptor) v = group.getEntityDescriptors();
+            for (VectorOf(EntityDescriptor)::size_type end = v.size(); end > 0; ) {
+                if (!removed[end - 1]) {
+                    --end;
+                    continue;
+                }
+                VectorOf(EntityDescriptor)::size_type start = end - 1;
+                while (start > 0 && removed[start - 1])
+                    --start;
+                v.erase(v.begin() + start, v.begin() + end);
+                end = start;
+            }
+        }
     };
 };
 
@@ -181,6 +202,19 @@ void MetadataProvider::doFilters(XMLObject& xmlObject) const
     }
 }
 
+void MetadataProvider::doFilters(XMLObject& xmlObject, const set<string>& excluded) const
+{
+    Category& log = Category::getInstance(SAML_LOGCAT".Metadata");
+    for (ptr_vector<MetadataFilter>::const_iterator i = m_filters.begin(); i != m_filters.end(); i++) {
+        if (excluded.count(i->getId())) {
+            log.debug("skipping metadata filter (%s)", i->getId());
+            continue;
+        }
+        log.debug("applying metadata filter (%s)", i->getId());
+        i->doFilter(m_filterContext, xmlObject);
+    }
+}
+
 void MetadataProvider::outputStatus(ostream& os) const
 {
 }
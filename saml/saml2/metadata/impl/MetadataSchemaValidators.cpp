@@ -264,6 +264,11 @@ namespace opensaml {
                 throw ValidationException("EntitiesDescriptor must contain at least one child descriptor.");
         END_XMLOBJECTVALIDATOR;
 
+        // Same rule the suite registers for the group, minus the descent into its children.
+        SAML_DLLLOCAL void validateGroupElement(const EntitiesDescriptor& group) {
+            EntitiesDescriptorSchemaValidator().validate(&group);
+        }
+
         XMLOBJECTVALIDATOR_SIMPLE(SAML_DLLLOCAL,SourceID);
 
         BEGIN_XMLOBJECTVALIDATOR_SUB(SAML_DLLLOCAL,DiscoveryResponse,IndexedEndpointType);
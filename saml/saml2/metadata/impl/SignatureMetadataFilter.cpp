@@ -29,15 +29,21 @@
 #include "saml2/metadata/MetadataFilter.h"
 #include "signature/SignatureProfileValidator.h"
 
+#include <boost/unordered_set.hpp>
 #include <xmltooling/logging.h>
 #include <xmltooling/XMLToolingConfig.h>
 #include <xmltooling/security/Credential.h>
 #include <xmltooling/security/CredentialCriteria.h>
 #include <xmltooling/security/CredentialResolver.h>
+#include <xmltooling/security/SecurityHelper.h>
 #include <xmltooling/security/SignatureTrustEngine.h>
 #include <xmltooling/signature/Signature.h>
 #include <xmltooling/signature/SignatureValidator.h>
 #include <xmltooling/util/NDC.h>
+#include <xmltooling/util/Threads.h>
+#include <xsec/dsig/DSIGSignature.hpp>
+#include <xsec/enc/XSECCryptoException.hpp>
+#include <xsec/framework/XSECException.hpp>
 
 using namespace opensaml::saml2md;
 using namespace opensaml;
@@ -62,8 +68,16 @@ namespace opensaml {
             void doFilter(EntitiesDescriptor& entities, bool rootObject=false) const;
             void doFilter(EntityDescriptor& entity, bool rootObject=false) const;
             void verifySignature(Signature* sig, const XMLCh* peerName) const;
+            string getCacheKey(const Signature& sig) const;
+            bool isVerified(const string& key) const;
+            void setVerified(const string& key) const;
+            void rollCache(bool force) const;
 
             bool m_verifyRoles,m_verifyName;
+            unsigned int m_cacheSize;
+            auto_ptr<Mutex> m_cacheLock;
+            // signatures verified during the current and previous filtering passes
+            mutable boost::unordered_set<string> m_verified,m_lastVerified;
             auto_ptr<CredentialResolver> m_credResolver,m_dummyResolver;
             auto_ptr<SignatureTrustEngine> m_trust;
             SignatureProfileValidator m_profileValidator;
@@ -86,12 +100,18 @@ static const XMLCh Certificate[] =          UNICODE_LITERAL_11(C,e,r,t,i,f,i,c,a
 static const XMLCh Path[] =                 UNICODE_LITERAL_4(P,a,t,h);
 static const XMLCh verifyRoles[] =          UNICODE_LITERAL_11(v,e,r,i,f,y,R,o,l,e,s);
 static const XMLCh verifyName[] =           UNICODE_LITERAL_10(v,e,r,i,f,y,N,a,m,e);
+static const XMLCh verifiedCacheSize[] =    UNICODE_LITERAL_17(v,e,r,i,f,i,e,d,C,a,c,h,e,S,i,z,e);
+static const XMLCh SignedInfo[] =           UNICODE_LITERAL_10(S,i,g,n,e,d,I,n,f,o);
 
 SignatureMetadataFilter::SignatureMetadataFilter(const DOMElement* e)
     : m_verifyRoles(XMLHelper::getAttrBool(e, false, verifyRoles)),
         m_verifyName(XMLHelper::getAttrBool(e, true, verifyName)),
+        m_cacheSize(XMLHelper::getAttrInt(e, 10000, verifiedCacheSize)),
         m_log(Category::getInstance(SAML_LOGCAT".MetadataFilter.Signature"))
 {
+    if (m_cacheSize > 0)
+        m_cacheLock.reset(Mutex::create());
+
     if (e && e->hasAttributeNS(nullptr,certificate)) {
         // Use a file-based credential resolver rooted here.
         m_credResolver.reset(XMLToolingConfig::getConfig().CredentialResolverManager.newPlugin(FILESYSTEM_CREDENTIAL_RESOLVER, e));
@@ -134,27 +154,33 @@ void SignatureMetadataFilter::doFilter(XMLObject& xmlObject) const
     NDC ndc("doFilter");
 #endif
 
+    // An object with a parent was unmarshalled apart from the rest of its instance (a lazily
+    // loaded entity), and the signature at the root was checked when the instance was loaded.
+    bool rootObject = (xmlObject.getParent() == nullptr);
+
     try {
         EntitiesDescriptor& entities = dynamic_cast<EntitiesDescriptor&>(xmlObject);
-        doFilter(entities, true);
+        doFilter(entities, rootObject);
+        rollCache(rootObject);
         return;
     }
     catch (bad_cast&) {
     }
     catch (exception& ex) {
-        m_log.warn("filtering out group at root of instance after failed signature check: %s", ex.what());
+        m_log.warn("filtering out group %s after failed signature check: %s", rootObject ? "at root of instance" : "detached from instance", ex.what());
         throw MetadataFilterException("SignatureMetadataFilter unable to verify signature at root of metadata instance.");
     }
 
     try {
         EntityDescriptor& entity = dynamic_cast<EntityDescriptor&>(xmlObject);
-        doFilter(entity, true);
+        doFilter(entity, rootObject);
+        rollCache(false);
         return;
     }
     catch (bad_cast&) {
     }
     catch (exception& ex) {
-        m_log.warn("filtering out entity at root of instance after failed signature check: %s", ex.what());
+        m_log.warn("filtering out entity %s after failed signature check: %s", rootObject ? "at root of instance" : "detached from instance", ex.what());
         throw MetadataFilterException("SignatureMetadataFilter unable to verify signature at root of metadata instance.");
     }
 
@@ -373,11 +399,38 @@ void SignatureMetadataFilter::verifySignature(Signature* sig, const XMLCh* peerN
         Locker locker(m_credResolver.get());
         vector<const Credential*> creds;
         if (m_credResolver->resolve(creds,&cc)) {
+            // A signature already verified with one of these keys only needs its content checked against the digest.
+            string sigKey = getCacheKey(*sig);
+            vector<string> keys;
+            if (!sigKey.empty()) {
+                for (vector<const Credential*>::const_iterator i = creds.begin(); i != creds.end(); ++i) {
+                    string key = sigKey + SecurityHelper::getDEREncoding(**i, "SHA1");
+                    if (isVerified(key)) {
+                        bool valid = false;
+                        try {
+                            valid = sig->getXMLSignature()->verifyReferences();
+                        }
+                        catch (XSECException&) {
+                        }
+                        catch (XSECCryptoException&) {
+                        }
+                        if (valid) {
+                            setVerified(key);
+                            return; // success!
+                        }
+                        throw MetadataFilterException("Signed content does not match the digest in the signature.");
+                    }
+                    keys.push_back(key);
+                }
+            }
+
             SignatureValidator sigValidator;
             for (vector<const Credential*>::const_iterator i = creds.begin(); i != creds.end(); ++i) {
                 try {
                     sigValidator.setCredential(*i);
                     sigValidator.validate(sig);
+                    if (!keys.empty())
+                        setVerified(keys[i - creds.begin()]);
                     return; // success!
                 }
                 catch (exception&) {
@@ -401,3 +454,48 @@ void SignatureMetadataFilter::verifySignature(Signature* sig, const XMLCh* peerN
 
     throw MetadataFilterException("Unable to verify signature.");
 }
+
+string SignatureMetadataFilter::getCacheKey(const Signature& sig) const
+{
+    if (m_cacheSize == 0 || !sig.getDOM() || !sig.getXMLSignature() || !sig.getXMLSignature()->getSignatureValue())
+        return string();
+
+    // The SignedInfo carries the digest and algorithms, and the value covers it.
+    const DOMElement* signedInfo = XMLHelper::getFirstChildElement(sig.getDOM(), xmlconstants::XMLSIG_NS, SignedInfo);
+    if (!signedInfo)
+        return string();
+    string buf;
+    XMLHelper::serialize(signedInfo, buf);
+    auto_ptr_char value(sig.getXMLSignature()->getSignatureValue());
+    if (value.get())
+        buf += value.get();
+    return SecurityHelper::doHash("SHA1", buf.data(), buf.length());
+}
+
+bool SignatureMetadataFilter::isVerified(const string& key) const
+{
+    Lock lock(m_cacheLock.get());
+    if (m_verified.count(key))
+        return true;
+    return m_lastVerified.count(key) > 0;
+}
+
+void SignatureMetadataFilter::setVerified(const string& key) const
+{
+    Lock lock(m_cacheLock.get());
+    m_verified.insert(key);
+}
+
+void SignatureMetadataFilter::rollCache(bool force) const
+{
+    if (m_cacheSize == 0)
+        return;
+
+    // Whole instances start a new generation so signatures that have gone away aren't kept,
+    // and single entities do once enough of them have been seen.
+    Lock lock(m_cacheLock.get());
+    if (force || m_verified.size() >= m_cacheSize) {
+        m_lastVerified.swap(m_verified);
+        m_verified.clear();
+    }
+}
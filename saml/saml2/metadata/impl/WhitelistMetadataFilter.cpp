@@ -31,6 +31,7 @@
 
 #include <boost/bind.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/unordered_set.hpp>
 #include <xmltooling/logging.h>
 
 using namespace opensaml::saml2md;
@@ -42,6 +43,10 @@ using namespace std;
 
 namespace opensaml {
     namespace saml2md {
+
+        // removes the flagged entities from a group (MetadataProvider.cpp)
+        SAML_DLLLOCAL void removeEntities(EntitiesDescriptor& group, const vector<bool>& removed);
+
         class SAML_DLLLOCAL WhitelistMetadataFilter : public MetadataFilter
         {
         public:
@@ -55,7 +60,7 @@ namespace opensaml {
             void filterGroup(EntitiesDescriptor*) const;
             bool included(const EntityDescriptor&) const;
 
-            set<xstring> m_entities;
+            boost::unordered_set<xstring> m_entities;
             scoped_ptr<EntityMatcher> m_matcher;
         };
 
@@ -109,18 +114,19 @@ void WhitelistMetadataFilter::filterGroup(EntitiesDescriptor* entities) const
 {
     Category& log = Category::getInstance(SAML_LOGCAT".MetadataFilter."WHITELIST_METADATA_FILTER);
 
-    VectorOf(EntityDescriptor) v = entities->getEntityDescriptors();
-    for (VectorOf(EntityDescriptor)::size_type i = 0; i < v.size(); ) {
+    // Decide on every entity first, so each one is matched once and removals can be batched.
+    const vector<EntityDescriptor*>& v = const_cast<const EntitiesDescriptor*>(entities)->getEntityDescriptors();
+    vector<bool> removed(v.size());
+    for (vector<EntityDescriptor*>::size_type i = 0; i < v.size(); ++i) {
         if (!included(*v[i])) {
             auto_ptr_char id(v[i]->getEntityID());
             log.info("filtering out non-whitelisted entity (%s)", id.get());
-            v.erase(v.begin() + i);
-        }
-        else {
-            i++;
+            removed[i] = true;
         }
     }
 
+    removeEntities(*entities, removed);
+
     const vector<EntitiesDescriptor*>& groups = const_cast<const EntitiesDescriptor*>(entities)->getEntitiesDescriptors();
     for_each(groups.begin(), groups.end(), boost::bind(&WhitelistMetadataFilter::filterGroup, this, _1));
 }
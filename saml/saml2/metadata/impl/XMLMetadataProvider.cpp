@@ -32,14 +32,21 @@
 #include "saml2/metadata/DiscoverableMetadataProvider.h"
 
 #include <fstream>
+#include <sstream>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/unordered_map.hpp>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <xmltooling/XMLToolingConfig.h>
 #include <xmltooling/io/HTTPResponse.h>
+#include <xmltooling/security/SecurityHelper.h>
 #include <xmltooling/util/DateTime.h>
 #include <xmltooling/util/NDC.h>
 #include <xmltooling/util/PathResolver.h>
 #include <xmltooling/util/ReloadableXMLFile.h>
 #include <xmltooling/util/Threads.h>
 #include <xmltooling/validation/ValidatorSuite.h>
+#include <xercesc/util/XMLChar.hpp>
 
 #if defined(OPENSAML_LOG4SHIB)
 # include <log4shib/NDC.hh>
@@ -61,6 +68,28 @@ using namespace std;
 namespace opensaml {
     namespace saml2md {
 
+        // applies the registered group validator without recursing (MetadataSchemaValidators.cpp)
+        SAML_DLLLOCAL void validateGroupElement(const EntitiesDescriptor& group);
+
+        // an entity held out of the tree of a lazily loaded instance until first use
+        struct SAML_DLLLOCAL lazy_entity_t {
+            lazy_entity_t(DOMElement* e, EntitiesDescriptor* parent) : m_dom(e), m_parent(parent), m_built(false) {
+            }
+
+            DOMElement* m_dom;
+            EntitiesDescriptor* m_parent;
+            scoped_ptr<EntityDescriptor> m_entity;
+            bool m_built;
+        };
+
+        // lookup tables for the entities of a lazily loaded instance, fixed once the instance is loaded
+        struct SAML_DLLLOCAL lazy_index_t {
+            typedef boost::unordered_map< string,vector<lazy_entity_t*> > entitymap_t;
+            ptr_vector<lazy_entity_t> m_entities;
+            entitymap_t m_sites;
+            entitymap_t m_sources;
+        };
+
         class SAML_DLLLOCAL XMLMetadataProvider
             : public AbstractMetadataProvider, public DiscoverableMetadataProvider, public ReloadableXMLFile
         {
@@ -79,9 +108,11 @@ namespace opensaml {
                         logging::NDC::push(threadid);
                     }
                     background_load();
+                    m_initialized = true;
                     startup();
                 }
                 catch (...) {
+                    m_initialized = true;
                     startup();
                     if (!m_id.empty()) {
                         logging::NDC::pop();
@@ -127,6 +158,20 @@ namespace opensaml {
                 return m_object.get();
             }
 
+            using AbstractMetadataProvider::getEntityDescriptor;
+            pair<const EntityDescriptor*,const RoleDescriptor*> getEntityDescriptor(const Criteria& criteria) const;
+
+            bool getEntityIDs(vector<string>& ids) const {
+                // Until something loads, there's no telling what will.
+                if (!m_object)
+                    return false;
+                if (!m_lazyIndex)
+                    return AbstractMetadataProvider::getEntityIDs(ids);
+                for (lazy_index_t::entitymap_t::const_iterator i = m_lazyIndex->m_sites.begin(); i != m_lazyIndex->m_sites.end(); ++i)
+                    ids.push_back(i->first);
+                return true;
+            }
+
         protected:
             pair<bool,DOMElement*> load(bool backup);
             pair<bool,DOMElement*> background_load();
@@ -135,11 +180,28 @@ namespace opensaml {
             using AbstractMetadataProvider::index;
             void index(time_t& validUntil);
             time_t computeNextRefresh();
+            void activate(scoped_ptr<XMLObject>& xmlObject, scoped_ptr<lazy_index_t>& lazy, bool backup, const string& digest);
+            void keepCurrent(bool backup);
+            XMLObject* loadSnapshot() const;
+            void writeSnapshot(const XMLObject& xmlObject) const;
+            string snapshotMAC(const string& tag, const string& body) const;
+            void validate(const XMLObject& xmlObject) const;
+            void validateGroup(const EntitiesDescriptor& group, vector<const EntityDescriptor*>& entities) const;
+            void validateSkeleton(const EntitiesDescriptor& group) const;
+            const EntityDescriptor* getLazyEntity(lazy_entity_t& entry) const;
+
+            // Digest of the document behind the current instance, which spares an identical reload
+            // from being unmarshalled, validated and filtered at all.
+            string m_digest;
 
             scoped_ptr<XMLObject> m_object;
-            bool m_discoveryFeed,m_dropDOM;
+            scoped_ptr<lazy_index_t> m_lazyIndex;
+            mutable auto_ptr<RWLock> m_lazyLock;
+            set<string> m_rootFilters;
+            bool m_discoveryFeed,m_dropDOM,m_snapshot,m_lazy,m_initialized;
+            string m_snapshotKey;
             double m_refreshDelayFactor;
-            unsigned int m_backoffFactor;
+            unsigned int m_backoffFactor,m_parallelism;
             time_t m_minRefreshDelay,m_maxRefreshDelay,m_lastValidUntil;
         };
 
@@ -148,10 +210,145 @@ namespace opensaml {
             return new XMLMetadataProvider(e);
         }
 
+        // work queue shared by the threads validating the entities in an instance
+        struct SAML_DLLLOCAL validation_t {
+            validation_t(const vector<const EntityDescriptor*>& entities)
+                : m_entities(entities), m_next(0), m_lock(Mutex::create()) {
+            }
+
+            // Hands out the next batch of entities, or false when the work is done or has failed.
+            bool next(vector<const EntityDescriptor*>::size_type& first, vector<const EntityDescriptor*>::size_type& last) {
+                Lock lock(m_lock);
+                if (!m_error.empty() || m_next >= m_entities.size())
+                    return false;
+                first = m_next;
+                last = m_next = min(m_next + 32, m_entities.size());
+                return true;
+            }
+
+            void fail(const char* msg) {
+                Lock lock(m_lock);
+                if (m_error.empty())
+                    m_error = (msg && *msg) ? msg : "unknown error";
+            }
+
+            const vector<const EntityDescriptor*>& m_entities;
+            vector<const EntityDescriptor*>::size_type m_next;
+            auto_ptr<Mutex> m_lock;
+            string m_error;
+        };
+
+        // an entity element taken out of the DOM while the rest of a lazy instance is unmarshalled
+        struct SAML_DLLLOCAL detached_t {
+            detached_t(DOMElement* e) : m_element(e), m_parent(e->getParentNode()), m_next(e->getNextSibling()) {
+            }
+
+            DOMElement* m_element;
+            DOMNode* m_parent;
+            DOMNode* m_next;
+        };
+
+        static void detachEntities(DOMElement* group, vector<detached_t>& detached)
+        {
+            DOMElement* child = XMLHelper::getFirstChildElement(group);
+            while (child) {
+                DOMElement* next = XMLHelper::getNextSiblingElement(child);
+                if (XMLHelper::isNodeNamed(child, samlconstants::SAML20MD_NS, EntityDescriptor::LOCAL_NAME)) {
+                    detached.push_back(detached_t(child));
+                    group->removeChild(child);
+                }
+                else if (XMLHelper::isNodeNamed(child, samlconstants::SAML20MD_NS, EntitiesDescriptor::LOCAL_NAME)) {
+                    detachEntities(child, detached);
+                }
+                child = next;
+            }
+        }
+
+        static void reattachEntities(vector<detached_t>& detached)
+        {
+            // Working backwards, each element's original next sibling is back in place before it's needed.
+            for (vector<detached_t>::reverse_iterator d = detached.rbegin(); d != detached.rend(); ++d)
+                d->m_parent->insertBefore(d->m_element, d->m_next);
+        }
+
+        static void collectGroups(EntitiesDescriptor* group, vector<EntitiesDescriptor*>& groups)
+        {
+            groups.push_back(group);
+            const vector<EntitiesDescriptor*>& subgroups = const_cast<const EntitiesDescriptor*>(group)->getEntitiesDescriptors();
+            for (vector<EntitiesDescriptor*>::const_iterator i = subgroups.begin(); i != subgroups.end(); ++i)
+                collectGroups(*i, groups);
+        }
+
+        static bool listsProtocol(const XMLCh* protocols, const XMLCh* protocol)
+        {
+            for (const XMLCh* token = protocols; token && *token; ) {
+                while (*token && XMLChar1_0::isWhitespace(*token))
+                    ++token;
+                const XMLCh* end = token;
+                while (*end && !XMLChar1_0::isWhitespace(*end))
+                    ++end;
+                if (end > token && xstring(token, end - token) == protocol)
+                    return true;
+                token = end;
+            }
+            return false;
+        }
+
+        // Reads the artifact source keys that indexEntity would give an entity straight from its element.
+        static void getSourceKeys(const DOMElement* e, const char* id, vector<string>& keys)
+        {
+            string hashed = SecurityHelper::doHash("SHA1", id, strlen(id));
+            const DOMElement* role = XMLHelper::getFirstChildElement(e, samlconstants::SAML20MD_NS, IDPSSODescriptor::LOCAL_NAME);
+            for (; role; role = XMLHelper::getNextSiblingElement(role, samlconstants::SAML20MD_NS, IDPSSODescriptor::LOCAL_NAME)) {
+                const XMLCh* protocols = role->getAttributeNS(nullptr, RoleDescriptor::PROTOCOLSUPPORTENUMERATION_ATTRIB_NAME);
+                if (listsProtocol(protocols, samlconstants::SAML10_PROTOCOL_ENUM) ||
+                        listsProtocol(protocols, samlconstants::SAML11_PROTOCOL_ENUM)) {
+                    const DOMElement* exts = XMLHelper::getFirstChildElement(role, samlconstants::SAML20MD_NS, Extensions::LOCAL_NAME);
+                    const DOMElement* sid = exts ? XMLHelper::getFirstChildElement(exts, samlconstants::SAML1MD_NS, SourceID::LOCAL_NAME) : nullptr;
+                    auto_ptr_char sourceid(sid ? sid->getTextContent() : nullptr);
+                    if (sourceid.get() && *sourceid.get())
+                        keys.push_back(sourceid.get());
+                    keys.push_back(hashed);
+                    const DOMElement* loc =
+                        XMLHelper::getFirstChildElement(role, samlconstants::SAML20MD_NS, ArtifactResolutionService::LOCAL_NAME);
+                    for (; loc; loc = XMLHelper::getNextSiblingElement(loc, samlconstants::SAML20MD_NS, ArtifactResolutionService::LOCAL_NAME)) {
+                        auto_ptr_char location(loc->getAttributeNS(nullptr, EndpointType::LOCATION_ATTRIB_NAME));
+                        if (location.get() && *location.get())
+                            keys.push_back(location.get());
+                    }
+                }
+                if (listsProtocol(protocols, samlconstants::SAML20P_NS))
+                    keys.push_back(hashed);
+            }
+        }
+
+        static void* validation_fn(void* arg)
+        {
+            validation_t* work = reinterpret_cast<validation_t*>(arg);
+            vector<const EntityDescriptor*>::size_type first, last;
+            try {
+                while (work->next(first, last)) {
+                    for (; first < last; ++first)
+                        SchemaValidators.validate(work->m_entities[first]);
+                }
+            }
+            catch (std::exception& ex) {
+                work->fail(ex.what());
+            }
+            return nullptr;
+        }
+
         static const XMLCh discoveryFeed[] =        UNICODE_LITERAL_13(d,i,s,c,o,v,e,r,y,F,e,e,d);
         static const XMLCh dropDOM[] =              UNICODE_LITERAL_7(d,r,o,p,D,O,M);
+        static const XMLCh lazy[] =                 UNICODE_LITERAL_4(l,a,z,y);
         static const XMLCh minRefreshDelay[] =      UNICODE_LITERAL_15(m,i,n,R,e,f,r,e,s,h,D,e,l,a,y);
+        static const XMLCh parallelism[] =          UNICODE_LITERAL_11(p,a,r,a,l,l,e,l,i,s,m);
         static const XMLCh refreshDelayFactor[] =   UNICODE_LITERAL_18(r,e,f,r,e,s,h,D,e,l,a,y,F,a,c,t,o,r);
+        static const XMLCh snapshot[] =             UNICODE_LITERAL_8(s,n,a,p,s,h,o,t);
+        static const XMLCh snapshotKeyPath[] =      UNICODE_LITERAL_15(s,n,a,p,s,h,o,t,K,e,y,P,a,t,h);
+
+        // first line of a snapshot file, to be bumped if the layout ever changes
+        static const char SNAPSHOT_VERSION[] = "OpenSAML metadata snapshot 2";
     };
 };
 
@@ -164,7 +361,11 @@ XMLMetadataProvider::XMLMetadataProvider(const DOMElement* e)
         ReloadableXMLFile(e, Category::getInstance(SAML_LOGCAT".MetadataProvider.XML"), false),
         m_discoveryFeed(XMLHelper::getAttrBool(e, true, discoveryFeed)),
         m_dropDOM(XMLHelper::getAttrBool(e, true, dropDOM)),
+        m_snapshot(XMLHelper::getAttrBool(e, false, snapshot)),
+        m_lazy(XMLHelper::getAttrBool(e, false, lazy)),
+        m_initialized(false),
         m_refreshDelayFactor(0.75), m_backoffFactor(1),
+        m_parallelism(XMLHelper::getAttrInt(e, 1, parallelism)),
         m_minRefreshDelay(XMLHelper::getAttrInt(e, 600, minRefreshDelay)),
         m_maxRefreshDelay(m_reloadInterval), m_lastValidUntil(SAMLTIME_MAX)
 {
@@ -184,6 +385,44 @@ XMLMetadataProvider::XMLMetadataProvider(const DOMElement* e)
             m_minRefreshDelay = m_maxRefreshDelay;
         }
     }
+
+    if (m_snapshot && m_backing.empty()) {
+        m_log.warn("snapshot option requires a backingFilePath, ignoring it");
+        m_snapshot = false;
+    }
+    else if (m_snapshot) {
+        // A snapshot is used in place of the filters, so anyone able to write one could otherwise inject
+        // metadata. It's only accepted with a MAC under a key that should be readable by this process alone,
+        // which makes it as trustworthy as that key; the backup itself is always filtered again.
+        string path(XMLHelper::getAttrString(e, nullptr, snapshotKeyPath));
+        if (!path.empty()) {
+            XMLToolingConfig::getConfig().getPathResolver()->resolve(path, PathResolver::XMLTOOLING_CFG_FILE);
+            ifstream keyfile(path.c_str(), ios::binary);
+            m_snapshotKey.assign(istreambuf_iterator<char>(keyfile), istreambuf_iterator<char>());
+        }
+        if (m_snapshotKey.empty()) {
+            m_log.warn("snapshot option requires a non-empty snapshotKeyPath, ignoring it");
+            m_snapshot = false;
+        }
+    }
+
+    if (m_lazy) {
+        // The feed and the snapshot would both need every entity unmarshalled.
+        if (m_discoveryFeed) {
+            m_log.warn("discovery feed is not supported in lazy mode, disabling it");
+            m_discoveryFeed = false;
+        }
+        if (m_snapshot) {
+            m_log.warn("snapshot option is not supported in lazy mode, ignoring it");
+            m_snapshot = false;
+        }
+        m_lazyLock.reset(RWLock::create());
+
+        // This filter acts on the root of an instance, so it's applied once at load time and skipped
+        // when the individual entities are built. The signature filter runs both times, checking the
+        // root at load time and then each entity's own signatures.
+        m_rootFilters.insert(REQUIREVALIDUNTIL_METADATA_FILTER);
+    }
 }
 
 pair<bool,DOMElement*> XMLMetadataProvider::load(bool backup)
@@ -192,6 +431,15 @@ pair<bool,DOMElement*> XMLMetadataProvider::load(bool backup)
         // Lower the refresh rate in case of an error.
         m_reloadInterval = m_minRefreshDelay;
     }
+    else if (m_snapshot) {
+        // A snapshot of the filtered backup spares us from validating and filtering it again.
+        scoped_ptr<XMLObject> xmlObject(loadSnapshot());
+        if (xmlObject) {
+            scoped_ptr<lazy_index_t> lazy;
+            activate(xmlObject, lazy, backup, string());
+            return make_pair(false,(DOMElement*)nullptr);
+        }
+    }
 
     // Call the base class to load/parse the appropriate XML resource.
     pair<bool,DOMElement*> raw = ReloadableXMLFile::load(backup);
@@ -199,6 +447,27 @@ pair<bool,DOMElement*> XMLMetadataProvider::load(bool backup)
     // If we own it, wrap it for now.
     XercesJanitor<DOMDocument> docjanitor(raw.first ? raw.second->getOwnerDocument() : nullptr);
 
+    // The same document again would only produce the same instance.
+    string digest;
+    if (m_lock) {
+        string buf;
+        XMLHelper::serialize(raw.second, buf);
+        digest = SecurityHelper::doHash("SHA1", buf.data(), buf.length());
+        if (m_object && digest == m_digest) {
+            if (!backup && !m_backing.empty()) {
+                Locker locker(getBackupLock());
+                preserveCacheTag();
+            }
+            keepCurrent(backup);
+            return make_pair(false,(DOMElement*)nullptr);
+        }
+    }
+
+    // In lazy mode, the entities inside a group are kept out of the object tree until they're used.
+    vector<detached_t> detached;
+    if (m_lazy && XMLHelper::isNodeNamed(raw.second, samlconstants::SAML20MD_NS, EntitiesDescriptor::LOCAL_NAME))
+        detachEntities(raw.second, detached);
+
     // Unmarshall objects, binding the document.
     scoped_ptr<XMLObject> xmlObject(XMLObjectBuilder::buildOneFromElement(raw.second, true));
     docjanitor.release();
@@ -208,9 +477,23 @@ pair<bool,DOMElement*> XMLMetadataProvider::load(bool backup)
             "Root of metadata instance not recognized: $1", params(1,xmlObject->getElementQName().toString().c_str())
             );
 
+    // Put the document back together so signature checks and backups see all of it, and note
+    // which group each entity belongs to while the groups still have their DOM.
+    map<const DOMNode*,EntitiesDescriptor*> groups;
+    if (!detached.empty()) {
+        reattachEntities(detached);
+        vector<EntitiesDescriptor*> tree;
+        collectGroups(dynamic_cast<EntitiesDescriptor*>(xmlObject.get()), tree);
+        for (vector<EntitiesDescriptor*>::const_iterator g = tree.begin(); g != tree.end(); ++g)
+            groups[(*g)->getDOM()] = *g;
+    }
+
     // Preprocess the metadata (even if we schema-validated).
     try {
-        SchemaValidators.validate(xmlObject.get());
+        if (detached.empty())
+            validate(*xmlObject);
+        else
+            validateSkeleton(dynamic_cast<const EntitiesDescriptor&>(*xmlObject));
     }
     catch (std::exception& ex) {
         m_log.error("metadata instance failed manual validation checking: %s", ex.what());
@@ -256,9 +539,51 @@ pair<bool,DOMElement*> XMLMetadataProvider::load(bool backup)
         if (rename(backupKey.c_str(), m_backing.c_str()) != 0)
             m_log.crit("unable to rename metadata backup file");
         preserveCacheTag();
+        if (m_snapshot)
+            writeSnapshot(*xmlObject);
     }
 
-    if (m_dropDOM) {
+    // Index the held back entities, skipping any whose group was filtered out.
+    scoped_ptr<lazy_index_t> lazy;
+    if (!detached.empty()) {
+        vector<EntitiesDescriptor*> tree;
+        collectGroups(dynamic_cast<EntitiesDescriptor*>(xmlObject.get()), tree);
+        set<const EntitiesDescriptor*> live(tree.begin(), tree.end());
+
+        lazy.reset(new lazy_index_t());
+        for (vector<detached_t>::const_iterator d = detached.begin(); d != detached.end(); ++d) {
+            EntitiesDescriptor* parent = groups[d->m_parent];
+            auto_ptr_char id(d->m_element->getAttributeNS(nullptr, EntityDescriptor::ENTITYID_ATTRIB_NAME));
+            if (!parent || !live.count(parent) || !id.get() || !*id.get())
+                continue;
+            lazy->m_entities.push_back(new lazy_entity_t(d->m_element, parent));
+            lazy_entity_t* entry = &lazy->m_entities.back();
+            lazy->m_sites[id.get()].push_back(entry);
+
+            // The same source keys the entity would be indexed under if it were built now.
+            vector<string> keys;
+            getSourceKeys(d->m_element, id.get(), keys);
+            for (vector<string>::const_iterator k = keys.begin(); k != keys.end(); ++k) {
+                vector<lazy_entity_t*>& sources = lazy->m_sources[*k];
+                if (sources.empty() || sources.back() != entry)
+                    sources.push_back(entry);
+            }
+        }
+        m_log.info("holding %lu entities for lazy unmarshalling", (unsigned long)lazy->m_entities.size());
+    }
+
+    activate(xmlObject, lazy, backup, digest);
+    return make_pair(false,(DOMElement*)nullptr);
+}
+
+void XMLMetadataProvider::activate(scoped_ptr<XMLObject>& xmlObject, scoped_ptr<lazy_index_t>& lazy, bool backup, const string& digest)
+{
+    // A lazy instance needs its document to build the entities from, but the groups let go of their
+    // DOM so that filtering an entity later has nothing shared to release.
+    if (lazy) {
+        xmlObject->releaseThisAndChildrenDOM();
+    }
+    else if (m_dropDOM) {
         xmlObject->releaseThisAndChildrenDOM();
         xmlObject->setDocument(nullptr);
     }
@@ -267,8 +592,11 @@ pair<bool,DOMElement*> XMLMetadataProvider::load(bool backup)
     if (m_lock)
         m_lock->wrlock();
     SharedLock locker(m_lock, false);
-    bool changed = m_object!=nullptr;
+    // Observers only hear about loads after init, including the first one if init didn't get it.
+    bool changed = m_object!=nullptr || m_initialized;
     m_object.swap(xmlObject);
+    m_lazyIndex.swap(lazy);
+    m_digest = digest;
     m_lastValidUntil = SAMLTIME_MAX;
     index(m_lastValidUntil);
     if (m_discoveryFeed)
@@ -288,7 +616,123 @@ pair<bool,DOMElement*> XMLMetadataProvider::load(bool backup)
     }
 
     m_loaded = true;
-    return make_pair(false,(DOMElement*)nullptr);
+}
+
+void XMLMetadataProvider::keepCurrent(bool backup)
+{
+    // The current objects, index, feed and credentials all still stand.
+    m_log.info("reloaded metadata is unchanged, keeping current instance");
+    if (m_lock)
+        m_lock->wrlock();
+    SharedLock locker(m_lock, false);
+    m_lastUpdate = time(nullptr);
+    if (!backup && !m_local) {
+        m_backoffFactor = 1;
+        m_reloadInterval = computeNextRefresh();
+        m_log.info("adjusted reload interval to %d seconds", m_reloadInterval);
+    }
+    m_loaded = true;
+}
+
+XMLObject* XMLMetadataProvider::loadSnapshot() const
+{
+    // The snapshot is only good if it was written after the backup file currently in place.
+    string path = m_backing + ".snapshot";
+#ifdef WIN32
+    struct _stat snap_buf, backing_buf;
+    if (_stat(path.c_str(), &snap_buf) != 0 || _stat(m_backing.c_str(), &backing_buf) != 0)
+        return nullptr;
+#else
+    struct stat snap_buf, backing_buf;
+    if (stat(path.c_str(), &snap_buf) != 0 || stat(m_backing.c_str(), &backing_buf) != 0)
+        return nullptr;
+#endif
+    if (snap_buf.st_mtime < backing_buf.st_mtime) {
+        m_log.info("ignoring metadata snapshot older than backup file (%s)", path.c_str());
+        return nullptr;
+    }
+
+    // It also has to belong to the version of the resource identified by the cache tag.
+    ifstream in(path.c_str(), ios::binary);
+    string version, tag, mac;
+    if (!getline(in, version) || version != SNAPSHOT_VERSION || !getline(in, tag) || tag != m_cacheTag || !getline(in, mac)) {
+        m_log.info("ignoring stale or incompatible metadata snapshot (%s)", path.c_str());
+        return nullptr;
+    }
+
+    // Nothing in it goes through the filters again, so it has to be one we wrote.
+    string body((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    if (mac != snapshotMAC(tag, body)) {
+        m_log.warn("ignoring metadata snapshot with invalid MAC (%s)", path.c_str());
+        return nullptr;
+    }
+
+    try {
+        istringstream src(body);
+        DOMDocument* doc = XMLToolingConfig::getConfig().getParser().parse(src);
+        XercesJanitor<DOMDocument> docjanitor(doc);
+        auto_ptr<XMLObject> xmlObject(XMLObjectBuilder::buildOneFromElement(doc->getDocumentElement(), true));
+        docjanitor.release();
+
+        const TimeBoundSAMLObject* validityCheck = dynamic_cast<TimeBoundSAMLObject*>(xmlObject.get());
+        if (!validityCheck || !validityCheck->isValid()) {
+            m_log.warn("metadata snapshot (%s) is no longer valid", path.c_str());
+            return nullptr;
+        }
+        m_log.info("loaded filtered metadata from snapshot (%s)", path.c_str());
+        return xmlObject.release();
+    }
+    catch (std::exception& ex) {
+        m_log.warn("unable to load metadata snapshot (%s): %s", path.c_str(), ex.what());
+    }
+    return nullptr;
+}
+
+void XMLMetadataProvider::writeSnapshot(const XMLObject& xmlObject) const
+{
+    // Caller holds the backup lock, so the snapshot is paired with the backup just committed.
+    string path = m_backing + ".snapshot", temp = path + ".tmp";
+    m_log.debug("writing snapshot of filtered metadata to (%s)", path.c_str());
+    try {
+        // Filtering may have released parts of the DOM, so this rebuilds whatever is missing.
+        DOMElement* dom = xmlObject.marshall();
+        string body;
+        XMLHelper::serialize(dom, body);
+        ofstream out(temp.c_str(), ios::binary);
+        out << SNAPSHOT_VERSION << '\n' << m_cacheTag << '\n' << snapshotMAC(m_cacheTag, body) << '\n' << body;
+        out.close();
+        if (!out)
+            throw IOException("Error writing metadata snapshot.");
+    }
+    catch (std::exception& ex) {
+        m_log.error("unable to write metadata snapshot: %s", ex.what());
+        remove(temp.c_str());
+        remove(path.c_str());
+        return;
+    }
+
+    remove(path.c_str());
+    if (rename(temp.c_str(), path.c_str()) != 0)
+        m_log.crit("unable to rename metadata snapshot file");
+}
+
+string XMLMetadataProvider::snapshotMAC(const string& tag, const string& body) const
+{
+    // HMAC-SHA1 (RFC 2104) over the cache tag and the document.
+    static const string::size_type blocksize = 64;
+    string key(m_snapshotKey.length() > blocksize ? SecurityHelper::doHash("SHA1", m_snapshotKey.data(), m_snapshotKey.length(), false) : m_snapshotKey);
+    key.resize(blocksize, '\0');
+    string inner(key), outer(key);
+    for (string::size_type i = 0; i < blocksize; ++i) {
+        inner[i] ^= 0x36;
+        outer[i] ^= 0x5c;
+    }
+    inner.reserve(blocksize + tag.length() + 1 + body.length());
+    inner += tag;
+    inner += '\n';
+    inner += body;
+    outer += SecurityHelper::doHash("SHA1", inner.data(), inner.length(), false);
+    return SecurityHelper::doHash("SHA1", outer.data(), outer.length());
 }
 
 pair<bool,DOMElement*> XMLMetadataProvider::background_load()
@@ -356,6 +800,192 @@ time_t XMLMetadataProvider::computeNextRefresh()
     }
 }
 
+void XMLMetadataProvider::validate(const XMLObject& xmlObject) const
+{
+    const EntitiesDescriptor* group = dynamic_cast<const EntitiesDescriptor*>(&xmlObject);
+    if (m_parallelism <= 1 || !group) {
+        SchemaValidators.validate(&xmlObject);
+        return;
+    }
+
+    // Validate the group structure here, and farm out the entities, which are independent of each other.
+    vector<const EntityDescriptor*> entities;
+    validateGroup(*group, entities);
+
+    validation_t work(entities);
+    vector<Thread*> threads;
+    for (unsigned int i = 1; i < m_parallelism && i * 32 < entities.size(); ++i) {
+        try {
+            threads.push_back(Thread::create(&validation_fn, &work));
+        }
+        catch (std::exception& ex) {
+            m_log.warn("unable to start metadata validation thread: %s", ex.what());
+            break;
+        }
+    }
+    m_log.debug("validating %lu entities using %lu additional thread(s)", (unsigned long)entities.size(), (unsigned long)threads.size());
+
+    // Take part in the work, then wait for the others.
+    validation_fn(&work);
+    for (vector<Thread*>::iterator t = threads.begin(); t != threads.end(); ++t) {
+        (*t)->join(nullptr);
+        delete *t;
+    }
+
+    if (!work.m_error.empty())
+        throw ValidationException(work.m_error.c_str());
+}
+
+void XMLMetadataProvider::validateGroup(const EntitiesDescriptor& group, vector<const EntityDescriptor*>& entities) const
+{
+    // The suite would recurse into the entities we're collecting, so only the group's own rule runs here.
+    validateGroupElement(group);
+
+    const list<XMLObject*>& children = group.getOrderedChildren();
+    for (list<XMLObject*>::const_iterator i = children.begin(); i != children.end(); ++i) {
+        if (!*i)
+            continue;
+        const EntityDescriptor* entity = dynamic_cast<const EntityDescriptor*>(*i);
+        if (entity) {
+            entities.push_back(entity);
+            continue;
+        }
+        const EntitiesDescriptor* subgroup = dynamic_cast<const EntitiesDescriptor*>(*i);
+        if (subgroup)
+            validateGroup(*subgroup, entities);
+        else
+            SchemaValidators.validate(*i);
+    }
+}
+
+void XMLMetadataProvider::validateSkeleton(const EntitiesDescriptor& group) const
+{
+    // The entities are back in the DOM but not in the tree, so the group rule is checked against the DOM.
+    if (group.getEntitiesDescriptors().empty() &&
+            !XMLHelper::getFirstChildElement(group.getDOM(), samlconstants::SAML20MD_NS, EntityDescriptor::LOCAL_NAME))
+        throw ValidationException("EntitiesDescriptor must contain at least one child descriptor.");
+
+    const list<XMLObject*>& children = group.getOrderedChildren();
+    for (list<XMLObject*>::const_iterator i = children.begin(); i != children.end(); ++i) {
+        if (!*i)
+            continue;
+        const EntitiesDescriptor* subgroup = dynamic_cast<const EntitiesDescriptor*>(*i);
+        if (subgroup)
+            validateSkeleton(*subgroup);
+        else
+            SchemaValidators.validate(*i);
+    }
+}
+
+const EntityDescriptor* XMLMetadataProvider::getLazyEntity(lazy_entity_t& entry) const
+{
+    // Once built, an entity only needs the lock to be shared.
+    SharedLock locker(m_lazyLock.get());
+    if (entry.m_built)
+        return entry.m_entity.get();
+    m_lazyLock->unlock();
+    m_lazyLock->wrlock();
+    if (entry.m_built)
+        return entry.m_entity.get();
+
+    // One attempt per load, so an entity that fails stays out until the next reload.
+    entry.m_built = true;
+    try {
+        auto_ptr<XMLObject> xmlObject(XMLObjectBuilder::buildOneFromElement(entry.m_dom));
+        EntityDescriptor* entity = dynamic_cast<EntityDescriptor*>(xmlObject.get());
+        if (!entity)
+            throw MetadataException("Lazily loaded element was not an EntityDescriptor.");
+        SchemaValidators.validate(entity);
+
+        // The group doesn't own the entity, but matchers in the filters may look at its ancestors,
+        // and the signature filter treats it as part of the instance rather than its root.
+        entity->setParent(entry.m_parent);
+        doFilters(*entity, m_rootFilters);
+
+        // Apply the validUntil fence from the enclosing groups, as indexing would have.
+        if (entry.m_parent->getValidUntilEpoch() < entity->getValidUntilEpoch())
+            entity->setValidUntil(entry.m_parent->getValidUntilEpoch());
+
+        // Likewise the endpoint lookup tables.
+        const list<XMLObject*>& members = entity->getOrderedChildren();
+        for (list<XMLObject*>::const_iterator member = members.begin(); member != members.end(); ++member) {
+            RoleDescriptor* role = dynamic_cast<RoleDescriptor*>(*member);
+            if (role)
+                role->indexEndpoints();
+        }
+        entry.m_entity.reset(entity);
+        xmlObject.release();
+    }
+    catch (std::exception& ex) {
+        auto_ptr_char id(entry.m_dom->getAttributeNS(nullptr, EntityDescriptor::ENTITYID_ATTRIB_NAME));
+        m_log.warn("filtering out entity (%s) after failure to load it: %s", id.get(), ex.what());
+    }
+    return entry.m_entity.get();
+}
+
+pair<const EntityDescriptor*,const RoleDescriptor*> XMLMetadataProvider::getEntityDescriptor(const Criteria& criteria) const
+{
+    if (!m_lazyIndex)
+        return AbstractMetadataProvider::getEntityDescriptor(criteria);
+
+    pair<const EntityDescriptor*,const RoleDescriptor*> result;
+    result.first = nullptr;
+    result.second = nullptr;
+
+    lazy_index_t::entitymap_t::const_iterator range;
+    if (criteria.entityID_ascii) {
+        range = m_lazyIndex->m_sites.find(criteria.entityID_ascii);
+        if (range == m_lazyIndex->m_sites.end())
+            return result;
+    }
+    else if (criteria.entityID_unicode) {
+        auto_ptr_char id(criteria.entityID_unicode);
+        range = m_lazyIndex->m_sites.find(id.get());
+        if (range == m_lazyIndex->m_sites.end())
+            return result;
+    }
+    else if (criteria.artifact) {
+        range = m_lazyIndex->m_sources.find(criteria.artifact->getSource());
+        if (range == m_lazyIndex->m_sources.end())
+            return result;
+    }
+    else {
+        return result;
+    }
+
+    time_t now = time(nullptr);
+    const EntityDescriptor* expired = nullptr;
+    for (vector<lazy_entity_t*>::const_iterator i = range->second.begin(); i != range->second.end(); ++i) {
+        const EntityDescriptor* entity = getLazyEntity(**i);
+        if (!entity)
+            continue;
+        if (now < entity->getValidUntilEpoch()) {
+            result.first = entity;
+            break;
+        }
+        if (!expired)
+            expired = entity;
+    }
+
+    if (!result.first && expired) {
+        if (criteria.validOnly) {
+            m_log.warn("ignored expired metadata instance for (%s)", range->first.c_str());
+        }
+        else {
+            m_log.info("no valid metadata found, returning expired instance for (%s)", range->first.c_str());
+            result.first = expired;
+        }
+    }
+
+    if (result.first && criteria.role) {
+        result.second = result.first->getRoleDescriptor(*criteria.role, criteria.protocol);
+        if (!result.second && criteria.protocol2)
+            result.second = result.first->getRoleDescriptor(*criteria.role, criteria.protocol2);
+    }
+
+    return result;
+}
+
 void XMLMetadataProvider::index(time_t& validUntil)
 {
     clearDescriptorIndex();
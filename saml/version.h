@@ -43,8 +43,8 @@
  */
 
 #define OPENSAML_VERSION_MAJOR 2
-#define OPENSAML_VERSION_MINOR 5
-#define OPENSAML_VERSION_REVISION 3
+#define OPENSAML_VERSION_MINOR 6
+#define OPENSAML_VERSION_REVISION 0
 
 /** DO NOT MODIFY BELOW THIS LINE */
 
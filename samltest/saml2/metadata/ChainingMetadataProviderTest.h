@@ -0,0 +1,131 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+#include "internal.h"
+#include <saml/SAMLConfig.h>
+#include <saml/saml2/metadata/Metadata.h>
+#include <saml/saml2/metadata/MetadataProvider.h>
+#include <xmltooling/util/Threads.h>
+
+#include <sstream>
+
+using namespace opensaml::saml2md;
+using namespace opensaml;
+
+class ChainingMetadataProviderTest : public CxxTest::TestSuite, public SAMLObjectBaseTestCase {
+    string local;
+
+    // Writes a single IdP entity to the local file.
+    void writeEntity(const char* id, const char* location) {
+        ofstream out(local.c_str(), ios::binary);
+        out << "<EntityDescriptor xmlns=\"urn:oasis:names:tc:SAML:2.0:metadata\" entityID=\"" << id << "\">"
+            "<IDPSSODescriptor protocolSupportEnumeration=\"urn:oasis:names:tc:SAML:2.0:protocol\">"
+            "<SingleSignOnService Binding=\"urn:oasis:names:tc:SAML:2.0:bindings:HTTP-Redirect\" Location=\"" << location << "\"/>"
+            "</IDPSSODescriptor></EntityDescriptor>";
+    }
+
+    // A chain of the local file followed by the InCommon sample.
+    MetadataProvider* buildChain(const char* precedence) {
+        string config(
+            "<MetadataProvider type=\"Chaining\" precedence=\"" + string(precedence) + "\">"
+            "<MetadataProvider type=\"XML\" path=\"" + local + "\" reloadChanges=\"true\" reloadInterval=\"1\"/>"
+            "<MetadataProvider type=\"XML\" path=\"" + data_path + "saml2/metadata/InCommon-metadata.xml\" reloadChanges=\"false\"/>"
+            "</MetadataProvider>"
+            );
+        istringstream in(config);
+        DOMDocument* doc = XMLToolingConfig::getConfig().getParser().parse(in);
+        XercesJanitor<DOMDocument> janitor(doc);
+        return SAMLConfig::getConfig().MetadataProviderManager.newPlugin(CHAINING_METADATA_PROVIDER, doc->getDocumentElement());
+    }
+
+    static const XMLCh* getLocation(const EntityDescriptor* entity) {
+        const IDPSSODescriptor* idp = (entity && !entity->getIDPSSODescriptors().empty()) ? entity->getIDPSSODescriptors().front() : nullptr;
+        return (idp && !idp->getSingleSignOnServices().empty()) ? idp->getSingleSignOnServices().front()->getLocation() : nullptr;
+    }
+
+    static void pause(int seconds) {
+        auto_ptr<Mutex> mutex(Mutex::create());
+        auto_ptr<CondWait> cond(CondWait::create());
+        Lock lock(mutex.get());
+        for (time_t until = time(nullptr) + seconds; time(nullptr) < until; )
+            cond->timedwait(mutex.get(), 1);
+    }
+
+public:
+    void setUp() {
+        local = "ChainingMetadataProviderTest-local.xml";
+        SAMLObjectBaseTestCase::setUp();
+    }
+
+    void tearDown() {
+        remove(local.c_str());
+        SAMLObjectBaseTestCase::tearDown();
+    }
+
+    void testChainingProviderPrecedence() {
+        // The local file overrides one of the InCommon entities.
+        writeEntity("urn:mace:incommon:washington.edu", "https://first.example.org/sso");
+        auto_ptr_XMLCh first("https://first.example.org/sso");
+
+        auto_ptr<MetadataProvider> chain(buildChain("first"));
+        chain->init();
+        {
+            Locker locker(chain.get());
+            const EntityDescriptor* entity =
+                chain->getEntityDescriptor(MetadataProvider::Criteria("urn:mace:incommon:washington.edu",nullptr,nullptr,false)).first;
+            TSM_ASSERT("Lookup did not find the shared entity", entity!=nullptr);
+            TSM_ASSERT("Shared entity did not come from the first provider", XMLString::equals(getLocation(entity), first.get()));
+            TSM_ASSERT("Lookup did not find an entity held only by the second provider",
+                chain->getEntityDescriptor(MetadataProvider::Criteria("urn:mace:incommon:psu.edu",nullptr,nullptr,false)).first!=nullptr);
+        }
+
+        chain.reset(buildChain("last"));
+        chain->init();
+        {
+            Locker locker(chain.get());
+            const EntityDescriptor* entity =
+                chain->getEntityDescriptor(MetadataProvider::Criteria("urn:mace:incommon:washington.edu",nullptr,nullptr,false)).first;
+            TSM_ASSERT("Lookup did not find the shared entity", entity!=nullptr);
+            TSM_ASSERT("Shared entity did not come from the last provider", !XMLString::equals(getLocation(entity), first.get()));
+        }
+    }
+
+    void testChainingProviderLateLoad() {
+        // The local file doesn't exist yet, so that provider fails to initialize.
+        remove(local.c_str());
+        auto_ptr<MetadataProvider> chain(buildChain("first"));
+        chain->init();
+        {
+            Locker locker(chain.get());
+            TSM_ASSERT("Lookup found an entity that doesn't exist yet",
+                chain->getEntityDescriptor(MetadataProvider::Criteria("https://late.example.org",nullptr,nullptr,false)).first==nullptr);
+        }
+
+        // Once it turns up and is loaded in the background, its entity resolves through the chain.
+        writeEntity("https://late.example.org", "https://late.example.org/sso");
+        bool found = false;
+        for (int attempt = 0; !found && attempt < 15; ++attempt) {
+            pause(1);
+            Locker locker(chain.get());
+            found = chain->getEntityDescriptor(MetadataProvider::Criteria("https://late.example.org",nullptr,nullptr,false)).first!=nullptr;
+        }
+        TSM_ASSERT("Entity from the late provider was not found", found);
+    }
+};
@@ -0,0 +1,244 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+#include "internal.h"
+#include <saml/SAMLConfig.h>
+#include <saml/saml2/metadata/DiscoverableMetadataProvider.h>
+#include <saml/saml2/metadata/Metadata.h>
+#include <saml/saml2/metadata/MetadataProvider.h>
+
+#include <sstream>
+#include <zlib.h>
+
+using namespace opensaml::saml2md;
+using namespace opensaml;
+
+// Exposes the helpers that frame the feeds of several providers as one gzip stream.
+struct CompressedFeedFraming : public DiscoverableMetadataProvider {
+    static void open(ostream& os, unsigned long& crc, unsigned long& length) {
+        openCompressedFeed(os, crc, length);
+    }
+    static void close(ostream& os, unsigned long& crc, unsigned long& length) {
+        closeCompressedFeed(os, crc, length);
+    }
+};
+
+class DiscoverableMetadataProviderTest : public CxxTest::TestSuite, public SAMLObjectBaseTestCase {
+    string local,local2;
+
+    static string idp(const char* id, const char* name) {
+        return string("<EntityDescriptor entityID=\"") + id + "\">"
+            "<IDPSSODescriptor protocolSupportEnumeration=\"urn:oasis:names:tc:SAML:2.0:protocol\">"
+            "<Extensions><mdui:UIInfo xmlns:mdui=\"urn:oasis:names:tc:SAML:metadata:ui\">"
+            "<mdui:DisplayName xml:lang=\"en\">" + name + "</mdui:DisplayName>"
+            "</mdui:UIInfo></Extensions>"
+            "<SingleSignOnService Binding=\"urn:oasis:names:tc:SAML:2.0:bindings:HTTP-Redirect\" Location=\"" + id + "/sso\"/>"
+            "</IDPSSODescriptor></EntityDescriptor>";
+    }
+
+    // Writes a group of entities to a local file.
+    static void writeGroup(const string& path, const string& entities) {
+        ofstream out(path.c_str(), ios::binary);
+        out << "<EntitiesDescriptor xmlns=\"urn:oasis:names:tc:SAML:2.0:metadata\">" << entities << "</EntitiesDescriptor>";
+    }
+
+    // A provider for a local file, watched for changes.
+    static MetadataProvider* buildProvider(const string& path, const char* options) {
+        string config("<MetadataProvider type=\"XML\" path=\"" + path + "\" reloadChanges=\"true\" " + options + "/>");
+        istringstream in(config);
+        DOMDocument* doc = XMLToolingConfig::getConfig().getParser().parse(in);
+        XercesJanitor<DOMDocument> janitor(doc);
+        return SAMLConfig::getConfig().MetadataProviderManager.newPlugin(XML_METADATA_PROVIDER, doc->getDocumentElement());
+    }
+
+    static string gunzip(const string& in) {
+        z_stream z;
+        memset(&z, 0, sizeof(z_stream));
+        TSM_ASSERT_EQUALS("zlib inflateInit2 failed", Z_OK, inflateInit2(&z, 16 + MAX_WBITS));
+        z.next_in = (Bytef*)in.data();
+        z.avail_in = in.length();
+        string out;
+        Bytef buf[16384];
+        int ret;
+        do {
+            z.next_out = buf;
+            z.avail_out = sizeof(buf);
+            ret = inflate(&z, Z_NO_FLUSH);
+            out.append((const char*)buf, sizeof(buf) - z.avail_out);
+        } while (ret == Z_OK);
+        inflateEnd(&z);
+        TSM_ASSERT_EQUALS("Compressed feed was not a complete gzip stream", Z_STREAM_END, ret);
+        TSM_ASSERT_EQUALS("Compressed feed had trailing data", 0U, z.avail_in);
+        return out;
+    }
+
+    static string feedOf(const MetadataProvider* provider, bool& first, bool wrapArray=true) {
+        ostringstream os;
+        dynamic_cast<const DiscoverableMetadataProvider*>(provider)->outputFeed(os, first, wrapArray);
+        return os.str();
+    }
+
+    static unsigned int count(const string& s, const char* what) {
+        unsigned int n = 0;
+        for (string::size_type pos = s.find(what); pos != string::npos; pos = s.find(what, pos + 1))
+            ++n;
+        return n;
+    }
+
+public:
+    void setUp() {
+        local = "DiscoverableMetadataProviderTest-local.xml";
+        local2 = "DiscoverableMetadataProviderTest-local2.xml";
+        SAMLObjectBaseTestCase::setUp();
+    }
+
+    void tearDown() {
+        remove(local.c_str());
+        remove(local2.c_str());
+        SAMLObjectBaseTestCase::tearDown();
+    }
+
+    void testRepeatedEntity() {
+        // The same entity twice gets two entries, neither rendered over the other.
+        writeGroup(local, idp("https://idp.example.org", "Example University") + idp("https://idp.example.org", "Example University"));
+        auto_ptr<MetadataProvider> provider(buildProvider(local, "searchableFeed=\"true\""));
+        provider->init();
+
+        Locker locker(provider.get());
+        const DiscoverableMetadataProvider* disco = dynamic_cast<const DiscoverableMetadataProvider*>(provider.get());
+        TSM_ASSERT("Provider is not discoverable", disco!=nullptr);
+
+        ostringstream feed;
+        bool first = true;
+        disco->outputFeed(feed, first);
+        TSM_ASSERT_EQUALS("Feed did not contain one entry per occurrence", 2U, count(feed.str(), "\"entityID\""));
+        TSM_ASSERT_EQUALS("Feed did not contain one name per occurrence", 2U, count(feed.str(), "Example University"));
+
+        vector< pair<unsigned int,string> > results;
+        TSM_ASSERT_EQUALS("Search did not find both entries", 2UL, disco->searchFeed("example", nullptr, results, 10));
+        TSM_ASSERT_EQUALS("Search did not return both entries", 2U, results.size());
+        for (vector< pair<unsigned int,string> >::const_iterator r = results.begin(); r != results.end(); ++r)
+            TSM_ASSERT_EQUALS("Entry was rendered more than once", 1U, count(r->second, "\"entityID\""));
+    }
+
+    void testSearchFeed() {
+        writeGroup(
+            local,
+            idp("https://idp.example.org", "Example University") +
+            idp("https://idp.example.net", "Example College") +
+            idp("https://sso.example.edu", "State University")
+            );
+        auto_ptr<MetadataProvider> provider(buildProvider(local, "searchableFeed=\"true\""));
+        provider->init();
+
+        Locker locker(provider.get());
+        const DiscoverableMetadataProvider* disco = dynamic_cast<const DiscoverableMetadataProvider*>(provider.get());
+        TSM_ASSERT("Provider is not discoverable", disco!=nullptr);
+
+        // A prefix matches names and entityIDs alike, but a name ranks above an entityID.
+        vector< pair<unsigned int,string> > results;
+        TSM_ASSERT_EQUALS("Prefix did not match every entry", 3UL, disco->searchFeed("exam", nullptr, results, 10));
+        TSM_ASSERT_EQUALS("Search did not return every entry", 3U, results.size());
+        TSM_ASSERT("Results were not ordered by rank", results[0].first >= results[1].first && results[1].first > results[2].first);
+        TSM_ASSERT("EntityID match outranked a name", results[2].second.find("sso.example.edu") != string::npos);
+
+        // Every word has to match, and the entry matching both by name comes first.
+        results.clear();
+        TSM_ASSERT_EQUALS("Words did not all have to match", 2UL, disco->searchFeed("Example Univ", nullptr, results, 10));
+        TSM_ASSERT("Best match was not first", results.front().second.find("Example University") != string::npos);
+
+        // Nothing found is nothing returned.
+        results.clear();
+        TSM_ASSERT_EQUALS("Unknown word matched", 0UL, disco->searchFeed("nowhere", nullptr, results, 10));
+        TSM_ASSERT("Unknown word returned results", results.empty());
+
+        // A page holds no more than its limit, but the total covers every match.
+        ostringstream page;
+        TSM_ASSERT_EQUALS("Page did not report the total", 3UL, disco->outputSearch(page, "example", nullptr, 1, 1));
+        TSM_ASSERT_EQUALS("Page did not hold one entry", 1U, count(page.str(), "\"entityID\""));
+        ostringstream past;
+        disco->outputSearch(past, "example", nullptr, 5, 10);
+        TSM_ASSERT_EQUALS("Page past the end was not empty", string("[\n]"), past.str());
+    }
+
+    void testCompressedFeed() {
+        // One provider keeps a compressed copy and the other compresses on output.
+        writeGroup(local, idp("https://idp.example.org", "Example University"));
+        writeGroup(local2, idp("https://idp.example.net", "Example College") + idp("https://idp2.example.net", "Example Institute"));
+        auto_ptr<MetadataProvider> kept(buildProvider(local, "compressFeed=\"true\""));
+        auto_ptr<MetadataProvider> onDemand(buildProvider(local2, ""));
+        kept->init();
+        onDemand->init();
+        Locker locker(kept.get());
+        Locker locker2(onDemand.get());
+
+        const MetadataProvider* providers[] = { kept.get(), onDemand.get() };
+        for (unsigned int i = 0; i < 2; ++i) {
+            ostringstream os;
+            bool first = true;
+            unsigned long crc, length;
+            dynamic_cast<const DiscoverableMetadataProvider*>(providers[i])->outputCompressedFeed(os, first, crc, length);
+            first = true;
+            TSM_ASSERT_EQUALS("Compressed feed did not match the feed", feedOf(providers[i], first), gunzip(os.str()));
+        }
+
+        // Both can be joined into one stream without recompressing either.
+        ostringstream os;
+        bool first = true;
+        unsigned long crc, length;
+        CompressedFeedFraming::open(os, crc, length);
+        dynamic_cast<const DiscoverableMetadataProvider*>(kept.get())->outputCompressedFeed(os, first, crc, length, false);
+        dynamic_cast<const DiscoverableMetadataProvider*>(onDemand.get())->outputCompressedFeed(os, first, crc, length, false);
+        CompressedFeedFraming::close(os, crc, length);
+        first = true;
+        string expected = '[' + feedOf(kept.get(), first, false) + feedOf(onDemand.get(), first, false) + "\n]";
+        TSM_ASSERT_EQUALS("Joined compressed feeds did not match the joined feeds", expected, gunzip(os.str()));
+    }
+
+    void testFeedTag() {
+        // The tag follows the content, not the provider or the load.
+        writeGroup(local, idp("https://idp.example.org", "Example University"));
+        writeGroup(local2, idp("https://idp.example.org", "Example University"));
+        auto_ptr<MetadataProvider> provider(buildProvider(local, ""));
+        provider->init();
+        Locker locker(provider.get());
+        string tag = dynamic_cast<const DiscoverableMetadataProvider*>(provider.get())->getCacheTag();
+        TSM_ASSERT("Feed tag was empty", !tag.empty());
+
+        auto_ptr<MetadataProvider> provider2(buildProvider(local2, ""));
+        provider2->init();
+        {
+            Locker locker2(provider2.get());
+            TSM_ASSERT_EQUALS(
+                "Identical feeds had different tags", tag, dynamic_cast<const DiscoverableMetadataProvider*>(provider2.get())->getCacheTag()
+                );
+        }
+
+        writeGroup(local2, idp("https://idp.example.net", "Example College"));
+        provider2.reset(buildProvider(local2, ""));
+        provider2->init();
+        {
+            Locker locker2(provider2.get());
+            TSM_ASSERT(
+                "Different feeds had the same tag", tag != dynamic_cast<const DiscoverableMetadataProvider*>(provider2.get())->getCacheTag()
+                );
+        }
+    }
+};
@@ -0,0 +1,278 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+#include "internal.h"
+#include <saml/SAMLConfig.h>
+#include <saml/saml2/metadata/Metadata.h>
+#include <saml/saml2/metadata/DynamicMetadataProvider.h>
+#include <xmltooling/io/HTTPResponse.h>
+#include <xmltooling/util/Threads.h>
+
+#include <sstream>
+
+using namespace opensaml::saml2md;
+using namespace opensaml;
+
+// Resolves a minimal entity for any entityID, counting the attempts, or answers that nothing changed
+// or with an entity other than the one asked for.
+class CountingMetadataProvider : public DynamicMetadataProvider
+{
+public:
+    CountingMetadataProvider(const DOMElement* e, int delay=0)
+        : DynamicMetadataProvider(e), m_delay(delay), m_notModified(false), m_mismatch(false), m_resolves(0),
+            m_lock(Mutex::create()), m_cond(CondWait::create()), m_counted(CondWait::create()) {
+        allowRefreshThreads();
+    }
+
+    ~CountingMetadataProvider() {
+        shutdown();
+    }
+
+    unsigned int getResolves() const {
+        Lock lock(m_lock.get());
+        return m_resolves;
+    }
+
+    unsigned int getResolves(const char* id) const {
+        Lock lock(m_lock.get());
+        map<string,unsigned int>::const_iterator i = m_resolvesOf.find(id);
+        return i != m_resolvesOf.end() ? i->second : 0;
+    }
+
+    // Waits up to the given number of seconds for an entity to have been resolved some number of times.
+    bool waitForResolves(const char* id, unsigned int count, int timeout) const {
+        Lock lock(m_lock.get());
+        for (time_t until = time(nullptr) + timeout; m_resolvesOf[id] < count && time(nullptr) < until; )
+            m_counted->timedwait(m_lock.get(), 1);
+        return m_resolvesOf[id] >= count;
+    }
+
+    void setNotModified(bool flag) {
+        Lock lock(m_lock.get());
+        m_notModified = flag;
+    }
+
+    void setMismatch(bool flag) {
+        Lock lock(m_lock.get());
+        m_mismatch = flag;
+    }
+
+protected:
+    EntityDescriptor* resolve(const Criteria& criteria) const {
+        Lock lock(m_lock.get());
+        ++m_resolves;
+        if (m_delay > 0)
+            m_cond->timedwait(m_lock.get(), m_delay);
+        if (m_notModified)
+            throw (long)HTTPResponse::XMLTOOLING_HTTP_STATUS_NOTMODIFIED;
+
+        string id(criteria.entityID_ascii ? criteria.entityID_ascii : "");
+        if (criteria.entityID_unicode) {
+            auto_ptr_char temp(criteria.entityID_unicode);
+            id = temp.get();
+        }
+        ++m_resolvesOf[id];
+        m_counted->broadcast();
+        if (m_mismatch)
+            id = "https://impostor.example.org";
+        istringstream in(
+            "<EntityDescriptor xmlns=\"urn:oasis:names:tc:SAML:2.0:metadata\" entityID=\"" + id + "\">"
+            "<IDPSSODescriptor protocolSupportEnumeration=\"urn:oasis:names:tc:SAML:2.0:protocol\">"
+            "<SingleSignOnService Binding=\"urn:oasis:names:tc:SAML:2.0:bindings:HTTP-Redirect\" Location=\"" + id + "/sso\"/>"
+            "</IDPSSODescriptor></EntityDescriptor>"
+            );
+        DOMDocument* doc = XMLToolingConfig::getConfig().getParser().parse(in);
+        XercesJanitor<DOMDocument> janitor(doc);
+        auto_ptr<XMLObject> xmlObject(XMLObjectBuilder::buildOneFromElement(doc->getDocumentElement(), true));
+        janitor.release();
+        EntityDescriptor* entity = dynamic_cast<EntityDescriptor*>(xmlObject.get());
+        xmlObject.release();
+        return entity;
+    }
+
+private:
+    int m_delay;
+    bool m_notModified;
+    bool m_mismatch;
+    mutable unsigned int m_resolves;
+    mutable map<string,unsigned int> m_resolvesOf;
+    auto_ptr<Mutex> m_lock;
+    auto_ptr<CondWait> m_cond,m_counted;
+};
+
+class DynamicMetadataProviderTest : public CxxTest::TestSuite, public SAMLObjectBaseTestCase {
+    DOMDocument* config;
+
+    struct lookup_t {
+        lookup_t(const MetadataProvider* provider, const char* id) : m_provider(provider), m_id(id), m_found(false) {
+        }
+        const MetadataProvider* m_provider;
+        const char* m_id;
+        bool m_found;
+    };
+
+    static void* lookup_fn(void* arg) {
+        lookup_t* lookup = reinterpret_cast<lookup_t*>(arg);
+        MetadataProvider* provider = const_cast<MetadataProvider*>(lookup->m_provider);
+        Locker locker(provider);
+        lookup->m_found = provider->getEntityDescriptor(MetadataProvider::Criteria(lookup->m_id,nullptr,nullptr,false)).first!=nullptr;
+        return nullptr;
+    }
+
+    DOMDocument* parseConfig(const char* xml) {
+        istringstream in(xml);
+        return XMLToolingConfig::getConfig().getParser().parse(in);
+    }
+
+public:
+    void setUp() {
+        config = parseConfig("<MetadataProvider type=\"Dynamic\"/>");
+        SAMLObjectBaseTestCase::setUp();
+    }
+
+    void tearDown() {
+        config->release();
+        SAMLObjectBaseTestCase::tearDown();
+    }
+
+    void testDynamicProviderSingleFlight() {
+        CountingMetadataProvider provider(config->getDocumentElement(), 1);
+        provider.init();
+
+        // Concurrent lookups of the same entity share a single resolution.
+        vector<lookup_t> lookups(8, lookup_t(&provider, "https://idp.example.org"));
+        vector<Thread*> threads;
+        for (vector<lookup_t>::iterator i = lookups.begin(); i != lookups.end(); ++i)
+            threads.push_back(Thread::create(&lookup_fn, &(*i)));
+        for (vector<Thread*>::iterator t = threads.begin(); t != threads.end(); ++t) {
+            (*t)->join(nullptr);
+            delete *t;
+        }
+
+        for (vector<lookup_t>::const_iterator i = lookups.begin(); i != lookups.end(); ++i)
+            TSM_ASSERT("Concurrent lookup did not find the entity", i->m_found);
+        TSM_ASSERT_EQUALS("Entity was resolved more than once", 1U, provider.getResolves());
+
+        // And later ones are answered from the cache.
+        lookup_t again(&provider, "https://idp.example.org");
+        lookup_fn(&again);
+        TSM_ASSERT("Cached lookup did not find the entity", again.m_found);
+        TSM_ASSERT_EQUALS("Cached entity was resolved again", 1U, provider.getResolves());
+    }
+
+    void testDynamicProviderRefreshesOnlyUsedEntities() {
+        // Every lookup is due for refresh as soon as it's cached, and scans run every second.
+        DOMDocument* doc = parseConfig(
+            "<MetadataProvider type=\"Dynamic\" refreshThreads=\"1\" minCacheDuration=\"0\" maxCacheDuration=\"0\"/>"
+            );
+        XercesJanitor<DOMDocument> janitor(doc);
+        CountingMetadataProvider provider(doc->getDocumentElement());
+        provider.init();
+
+        lookup_t used(&provider, "https://used.example.org"), unused(&provider, "https://unused.example.org");
+        lookup_fn(&used);
+        lookup_fn(&unused);
+        TSM_ASSERT("Lookups did not find the entities", used.m_found && unused.m_found);
+
+        // Asking for one again returns the cached copy and gets it refreshed in the background.
+        lookup_fn(&used);
+        TSM_ASSERT("Lookup did not find the cached entity", used.m_found);
+        TSM_ASSERT("Used entity was not refreshed", provider.waitForResolves("https://used.example.org", 2, 10));
+
+        // The scan that found it due also found the other one, which nobody has asked for since.
+        TSM_ASSERT_EQUALS("Unused entity was refreshed", 1U, provider.getResolves("https://unused.example.org"));
+        TSM_ASSERT_EQUALS("Used entity was refreshed more than once", 2U, provider.getResolves("https://used.example.org"));
+    }
+
+    void testDynamicProviderEviction() {
+        DOMDocument* doc = parseConfig("<MetadataProvider type=\"Dynamic\" maxEntities=\"2\"/>");
+        XercesJanitor<DOMDocument> janitor(doc);
+        CountingMetadataProvider provider(doc->getDocumentElement());
+        provider.init();
+
+        lookup_t a(&provider, "https://a.example.org"), b(&provider, "https://b.example.org"), c(&provider, "https://c.example.org");
+        lookup_fn(&a);
+        lookup_fn(&b);
+        lookup_fn(&c);
+        TSM_ASSERT("Lookups did not find the entities", a.m_found && b.m_found && c.m_found);
+        TSM_ASSERT_EQUALS("Unexpected number of resolutions", 3U, provider.getResolves());
+
+        // The least recently used entity made room for the third one, and the others are still cached.
+        lookup_fn(&b);
+        lookup_fn(&c);
+        TSM_ASSERT_EQUALS("Cached entity was resolved again", 3U, provider.getResolves());
+        lookup_fn(&a);
+        TSM_ASSERT("Lookup did not find the evicted entity", a.m_found);
+        TSM_ASSERT_EQUALS("Evicted entity was not resolved again", 4U, provider.getResolves());
+
+        // Bringing it back pushed out b, the one used least recently.
+        lookup_fn(&c);
+        TSM_ASSERT_EQUALS("Cached entity was resolved again", 4U, provider.getResolves());
+        lookup_fn(&b);
+        TSM_ASSERT_EQUALS("Evicted entity was not resolved again", 5U, provider.getResolves());
+    }
+
+    void testDynamicProviderNotModified() {
+        // Every lookup is due for refresh as soon as it's cached, and scans run every second.
+        DOMDocument* doc = parseConfig(
+            "<MetadataProvider type=\"Dynamic\" refreshThreads=\"1\" minCacheDuration=\"0\" maxCacheDuration=\"0\"/>"
+            );
+        XercesJanitor<DOMDocument> janitor(doc);
+        CountingMetadataProvider provider(doc->getDocumentElement());
+        provider.init();
+
+        const EntityDescriptor* entity = nullptr;
+        {
+            Locker locker(&provider);
+            entity = provider.getEntityDescriptor(MetadataProvider::Criteria("https://idp.example.org",nullptr,nullptr,false)).first;
+            TSM_ASSERT("Lookup did not find the entity", entity!=nullptr);
+        }
+
+        // Asking again gets it refreshed, and an unchanged answer keeps the cached copy.
+        provider.setNotModified(true);
+        lookup_t lookup(&provider, "https://idp.example.org");
+        lookup_fn(&lookup);
+        TSM_ASSERT("Entity was not refreshed", provider.waitForResolves("https://idp.example.org", 2, 10));
+        Locker locker(&provider);
+        TSM_ASSERT_EQUALS(
+            "Unchanged entity was replaced", entity,
+            provider.getEntityDescriptor(MetadataProvider::Criteria("https://idp.example.org",nullptr,nullptr,false)).first
+            );
+    }
+
+    void testDynamicProviderMismatch() {
+        CountingMetadataProvider provider(config->getDocumentElement());
+        provider.init();
+
+        // An answer for some other entity is rejected rather than cached under the one asked for.
+        provider.setMismatch(true);
+        lookup_t lookup(&provider, "https://idp.example.org");
+        lookup_fn(&lookup);
+        TSM_ASSERT("Mismatched entity was accepted", !lookup.m_found);
+        TSM_ASSERT_EQUALS("Entity was not resolved", 1U, provider.getResolves());
+
+        // Nor is it kept under its own name.
+        provider.setMismatch(false);
+        lookup_t impostor(&provider, "https://impostor.example.org");
+        lookup_fn(&impostor);
+        TSM_ASSERT("Lookup did not find the entity", impostor.m_found);
+        TSM_ASSERT_EQUALS("Rejected entity was cached", 2U, provider.getResolves());
+    }
+};
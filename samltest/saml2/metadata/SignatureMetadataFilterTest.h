@@ -0,0 +1,132 @@
+/**
+ * Licensed to the University Corporation for Advanced Internet
+ * Development, Inc. (UCAID) under one or more contributor license
+ * agreements. See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.
+ *
+ * UCAID licenses this file to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file except
+ * in compliance with the License. You may obtain a copy of the
+ * License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ */
+
+#include "internal.h"
+#include <saml/SAMLConfig.h>
+#include <saml/saml2/metadata/Metadata.h>
+#include <saml/saml2/metadata/MetadataFilter.h>
+#include <xmltooling/security/Credential.h>
+#include <xmltooling/security/CredentialCriteria.h>
+#include <xmltooling/security/CredentialResolver.h>
+#include <xmltooling/signature/Signature.h>
+
+#include <sstream>
+
+using namespace opensaml::saml2md;
+using namespace opensaml;
+using namespace xmlsignature;
+
+class SignatureMetadataFilterTest : public CxxTest::TestSuite, public SAMLObjectBaseTestCase {
+    string signedMetadata;
+
+    XMLObject* parseMetadata(const string& xml, const char* tamperedLocation=nullptr) {
+        istringstream in(xml);
+        DOMDocument* doc = XMLToolingConfig::getConfig().getParser().parse(in);
+        XercesJanitor<DOMDocument> janitor(doc);
+        if (tamperedLocation) {
+            auto_ptr_XMLCh loc(tamperedLocation);
+            auto_ptr_XMLCh attr("Location");
+            DOMElement* sso = XMLHelper::getFirstChildElement(
+                XMLHelper::getFirstChildElement(
+                    XMLHelper::getFirstChildElement(doc->getDocumentElement(), samlconstants::SAML20MD_NS, EntityDescriptor::LOCAL_NAME),
+                    samlconstants::SAML20MD_NS, IDPSSODescriptor::LOCAL_NAME
+                    ),
+                samlconstants::SAML20MD_NS, SingleSignOnService::LOCAL_NAME
+                );
+            sso->setAttributeNS(nullptr, attr.get(), loc.get());
+        }
+        XMLObject* xmlObject = XMLObjectBuilder::buildOneFromElement(doc->getDocumentElement(), true);
+        janitor.release();
+        return xmlObject;
+    }
+
+    MetadataFilter* buildFilter() {
+        string config(
+            "<MetadataFilter type=\"Signature\"><CredentialResolver type=\"File\"><Certificate><Path>" +
+            data_path + "cert.pem</Path></Certificate></CredentialResolver></MetadataFilter>"
+            );
+        istringstream in(config);
+        DOMDocument* doc = XMLToolingConfig::getConfig().getParser().parse(in);
+        XercesJanitor<DOMDocument> janitor(doc);
+        return SAMLConfig::getConfig().MetadataFilterManager.newPlugin(SIGNATURE_METADATA_FILTER, doc->getDocumentElement());
+    }
+
+public:
+    void setUp() {
+        SAMLObjectBaseTestCase::setUp();
+
+        // A small aggregate signed with the test key.
+        auto_ptr<XMLObject> metadata(parseMetadata(
+            "<EntitiesDescriptor xmlns=\"urn:oasis:names:tc:SAML:2.0:metadata\" ID=\"metadata\">"
+            "<EntityDescriptor entityID=\"https://idp.example.org\">"
+            "<IDPSSODescriptor protocolSupportEnumeration=\"urn:oasis:names:tc:SAML:2.0:protocol\">"
+            "<SingleSignOnService Binding=\"urn:oasis:names:tc:SAML:2.0:bindings:HTTP-Redirect\" Location=\"https://idp.example.org/sso\"/>"
+            "</IDPSSODescriptor></EntityDescriptor></EntitiesDescriptor>"
+            ));
+        EntitiesDescriptor* group = dynamic_cast<EntitiesDescriptor*>(metadata.get());
+        group->releaseThisAndChildrenDOM();
+        group->setDocument(nullptr);
+        Signature* sig = SignatureBuilder::buildSignature();
+        group->setSignature(sig);
+
+        string config = data_path + "FilesystemCredentialResolver.xml";
+        ifstream in(config.c_str());
+        DOMDocument* doc = XMLToolingConfig::getConfig().getParser().parse(in);
+        XercesJanitor<DOMDocument> janitor(doc);
+        auto_ptr<CredentialResolver> resolver(
+            XMLToolingConfig::getConfig().CredentialResolverManager.newPlugin(FILESYSTEM_CREDENTIAL_RESOLVER, doc->getDocumentElement())
+            );
+        Locker locker(resolver.get());
+        CredentialCriteria cc;
+        cc.setUsage(Credential::SIGNING_CREDENTIAL);
+        vector<Signature*> sigs(1, sig);
+        DOMElement* root = group->marshall((DOMDocument*)nullptr, &sigs, resolver->resolve(&cc));
+        signedMetadata.erase();
+        XMLHelper::serialize(root, signedMetadata);
+    }
+
+    void tearDown() {
+        SAMLObjectBaseTestCase::tearDown();
+    }
+
+    void testSignatureCache() {
+        auto_ptr<MetadataFilter> filter(buildFilter());
+
+        // The first check is done in full and remembered.
+        auto_ptr<XMLObject> metadata(parseMetadata(signedMetadata));
+        filter->doFilter(*metadata);
+
+        // The same signature again is accepted without repeating the public key operation.
+        metadata.reset(parseMetadata(signedMetadata));
+        filter->doFilter(*metadata);
+        TSM_ASSERT_EQUALS("Entity was filtered out", 1U, dynamic_cast<EntitiesDescriptor*>(metadata.get())->getEntityDescriptors().size());
+
+        // But the signed content is still checked against it.
+        metadata.reset(parseMetadata(signedMetadata, "https://attacker.example.org/sso"));
+        TS_ASSERT_THROWS(filter->doFilter(*metadata), MetadataFilterException);
+
+        // And a fresh filter that has nothing remembered reaches the same verdicts.
+        filter.reset(buildFilter());
+        metadata.reset(parseMetadata(signedMetadata, "https://attacker.example.org/sso"));
+        TS_ASSERT_THROWS(filter->doFilter(*metadata), MetadataFilterException);
+        metadata.reset(parseMetadata(signedMetadata));
+        filter->doFilter(*metadata);
+    }
+};
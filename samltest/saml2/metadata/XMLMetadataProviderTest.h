@@ -20,10 +20,16 @@
 
 #include "internal.h"
 #include <saml/SAMLConfig.h>
+#include <saml/saml1/binding/SAMLArtifactType0001.h>
+#include <saml/saml1/binding/SAMLArtifactType0002.h>
 #include <saml/saml2/binding/SAML2ArtifactType0004.h>
+#include <saml/saml2/metadata/EndpointManager.h>
 #include <saml/saml2/metadata/Metadata.h>
 #include <saml/saml2/metadata/MetadataProvider.h>
 #include <xmltooling/security/SecurityHelper.h>
+#include <xmltooling/util/Threads.h>
+
+#include <sstream>
 
 using namespace opensaml::saml2md;
 using namespace opensaml::saml2p;
@@ -93,6 +99,328 @@ public:
         assertEquals("Entity's ID does not match requested ID", entityID, descriptor->getEntityID());
     }
 
+    void testXMLProviderParallel() {
+        string config = data_path + "saml2/metadata/XMLMetadataProvider.xml";
+        ifstream in(config.c_str());
+        DOMDocument* doc=XMLToolingConfig::getConfig().getParser().parse(in);
+        XercesJanitor<DOMDocument> janitor(doc);
+
+        auto_ptr_XMLCh path("path");
+        string s = data_path + "saml2/metadata/InCommon-metadata.xml";
+        auto_ptr_XMLCh file(s.c_str());
+        doc->getDocumentElement()->setAttributeNS(nullptr,path.get(),file.get());
+        auto_ptr_XMLCh parallelism("parallelism");
+        auto_ptr_XMLCh threads("4");
+        doc->getDocumentElement()->setAttributeNS(nullptr,parallelism.get(),threads.get());
+
+        auto_ptr<MetadataProvider> metadataProvider(
+            SAMLConfig::getConfig().MetadataProviderManager.newPlugin(XML_METADATA_PROVIDER,doc->getDocumentElement())
+            );
+        try {
+            metadataProvider->init();
+        }
+        catch (XMLToolingException& ex) {
+            TS_TRACE(ex.what());
+            throw;
+        }
+
+        Locker locker(metadataProvider.get());
+        const EntityDescriptor* descriptor = metadataProvider->getEntityDescriptor(MetadataProvider::Criteria(entityID,nullptr,nullptr,false)).first;
+        TSM_ASSERT("Retrieved entity descriptor was null", descriptor!=nullptr);
+        assertEquals("Entity's ID does not match requested ID", entityID, descriptor->getEntityID());
+        descriptor = metadataProvider->getEntityDescriptor(MetadataProvider::Criteria(entityID2,nullptr,nullptr,false)).first;
+        TSM_ASSERT("Retrieved entity descriptor was null", descriptor!=nullptr);
+        assertEquals("Entity's ID does not match requested ID", entityID2, descriptor->getEntityID());
+    }
+
+    void testXMLProviderLazy() {
+        string config = data_path + "saml2/metadata/XMLWithBlacklists.xml";
+        ifstream in(config.c_str());
+        DOMDocument* doc=XMLToolingConfig::getConfig().getParser().parse(in);
+        XercesJanitor<DOMDocument> janitor(doc);
+
+        auto_ptr_XMLCh path("path");
+        string s = data_path + "saml2/metadata/InCommon-metadata.xml";
+        auto_ptr_XMLCh file(s.c_str());
+        doc->getDocumentElement()->setAttributeNS(nullptr,path.get(),file.get());
+        auto_ptr_XMLCh lazy("lazy");
+        auto_ptr_XMLCh flag("true");
+        doc->getDocumentElement()->setAttributeNS(nullptr,lazy.get(),flag.get());
+
+        auto_ptr<MetadataProvider> metadataProvider(
+            SAMLConfig::getConfig().MetadataProviderManager.newPlugin(XML_METADATA_PROVIDER,doc->getDocumentElement())
+            );
+        try {
+            metadataProvider->init();
+        }
+        catch (XMLToolingException& ex) {
+            TS_TRACE(ex.what());
+            throw;
+        }
+
+        Locker locker(metadataProvider.get());
+        const EntityDescriptor* descriptor = metadataProvider->getEntityDescriptor(MetadataProvider::Criteria(entityID,nullptr,nullptr,false)).first;
+        TSM_ASSERT("Retrieved entity descriptor was not null", descriptor==nullptr);
+        descriptor = metadataProvider->getEntityDescriptor(MetadataProvider::Criteria(entityID2,nullptr,nullptr,false)).first;
+        TSM_ASSERT("Retrieved entity descriptor was null", descriptor!=nullptr);
+        assertEquals("Entity's ID does not match requested ID", entityID2, descriptor->getEntityID());
+        TSM_ASSERT("Entity was not parented by its group", descriptor->getParent()!=nullptr);
+        TSM_ASSERT_EQUALS(
+            "Repeated lookup built a new entity descriptor", descriptor,
+            metadataProvider->getEntityDescriptor(MetadataProvider::Criteria(entityID2,nullptr,nullptr,false)).first
+            );
+    }
+
+    void assertArtifact(const MetadataProvider& provider, const SAMLArtifact& artifact, const char* expected) {
+        const EntityDescriptor* descriptor = provider.getEntityDescriptor(MetadataProvider::Criteria(&artifact,nullptr,nullptr,false)).first;
+        TSM_ASSERT("Artifact did not resolve to an entity", descriptor!=nullptr);
+        if (descriptor) {
+            auto_ptr_XMLCh id(expected);
+            assertEquals("Entity's ID does not match the artifact's source", id.get(), descriptor->getEntityID());
+        }
+    }
+
+    void testXMLProviderLazyArtifacts() {
+        // A SAML 1.1 IdP with its own SourceID and an artifact resolution endpoint, in a local group.
+        static const char* idpStr = "https://idp.example.org";
+        string local("XMLMetadataProviderTest-lazy.xml");
+        string sourceid = SecurityHelper::doHash("SHA1", "another source", 14, false);
+        {
+            ofstream dest(local.c_str(), ios::binary);
+            dest << "<EntitiesDescriptor xmlns=\"urn:oasis:names:tc:SAML:2.0:metadata\">"
+                "<EntityDescriptor entityID=\"" << idpStr << "\">"
+                "<IDPSSODescriptor protocolSupportEnumeration=\"urn:oasis:names:tc:SAML:1.1:protocol\">"
+                "<Extensions><saml1md:SourceID xmlns:saml1md=\"urn:oasis:names:tc:SAML:profiles:v1metadata\">"
+                << SecurityHelper::doHash("SHA1", "another source", 14) << "</saml1md:SourceID></Extensions>"
+                "<ArtifactResolutionService Binding=\"urn:oasis:names:tc:SAML:1.0:bindings:SOAP-binding\""
+                " Location=\"https://idp.example.org/artifact\" index=\"1\"/>"
+                "<SingleSignOnService Binding=\"urn:mace:shibboleth:1.0:profiles:AuthnRequest\" Location=\"https://idp.example.org/sso\"/>"
+                "</IDPSSODescriptor></EntityDescriptor></EntitiesDescriptor>";
+        }
+
+        string config("<MetadataProvider type=\"XML\" path=\"" + local + "\" lazy=\"true\"/>");
+        istringstream in(config);
+        DOMDocument* doc=XMLToolingConfig::getConfig().getParser().parse(in);
+        XercesJanitor<DOMDocument> janitor(doc);
+
+        auto_ptr<MetadataProvider> metadataProvider(
+            SAMLConfig::getConfig().MetadataProviderManager.newPlugin(XML_METADATA_PROVIDER,doc->getDocumentElement())
+            );
+        metadataProvider->init();
+
+        // Every artifact the eager index would resolve resolves before the entity is ever built.
+        Locker locker(metadataProvider.get());
+        SAMLArtifactType0001 bySourceID(sourceid);
+        assertArtifact(*metadataProvider, bySourceID, idpStr);
+        SAMLArtifactType0001 byHash(SecurityHelper::doHash("SHA1", idpStr, strlen(idpStr), false));
+        assertArtifact(*metadataProvider, byHash, idpStr);
+        SAMLArtifactType0002 byLocation(string("https://idp.example.org/artifact"));
+        assertArtifact(*metadataProvider, byLocation, idpStr);
+        remove(local.c_str());
+    }
+
+    void testXMLProviderEndpointTables() {
+        // An SP whose default endpoint is neither first nor first for its binding.
+        static const char* spStr = "https://sp.example.org";
+        string local("XMLMetadataProviderTest-endpoints.xml");
+        {
+            ofstream dest(local.c_str(), ios::binary);
+            dest << "<EntityDescriptor xmlns=\"urn:oasis:names:tc:SAML:2.0:metadata\" entityID=\"" << spStr << "\">"
+                "<SPSSODescriptor protocolSupportEnumeration=\"urn:oasis:names:tc:SAML:2.0:protocol\">"
+                "<AssertionConsumerService Binding=\"urn:oasis:names:tc:SAML:2.0:bindings:HTTP-POST\""
+                " Location=\"https://sp.example.org/post\" index=\"1\"/>"
+                "<AssertionConsumerService Binding=\"urn:oasis:names:tc:SAML:2.0:bindings:HTTP-Artifact\""
+                " Location=\"https://sp.example.org/artifact\" index=\"2\"/>"
+                "<AssertionConsumerService Binding=\"urn:oasis:names:tc:SAML:2.0:bindings:HTTP-POST\""
+                " Location=\"https://sp.example.org/post-default\" index=\"3\" isDefault=\"true\"/>"
+                "</SPSSODescriptor></EntityDescriptor>";
+        }
+
+        string config("<MetadataProvider type=\"XML\" path=\"" + local + "\"/>");
+        istringstream in(config);
+        DOMDocument* doc=XMLToolingConfig::getConfig().getParser().parse(in);
+        XercesJanitor<DOMDocument> janitor(doc);
+
+        auto_ptr<MetadataProvider> metadataProvider(
+            SAMLConfig::getConfig().MetadataProviderManager.newPlugin(XML_METADATA_PROVIDER,doc->getDocumentElement())
+            );
+        metadataProvider->init();
+
+        Locker locker(metadataProvider.get());
+        const EntityDescriptor* descriptor =
+            metadataProvider->getEntityDescriptor(MetadataProvider::Criteria(spStr,nullptr,nullptr,false)).first;
+        TSM_ASSERT("Retrieved entity descriptor was null", descriptor!=nullptr);
+        const SPSSODescriptor* sp = descriptor->getSPSSODescriptors().front();
+        const vector<AssertionConsumerService*>& acs = sp->getAssertionConsumerServices();
+        TSM_ASSERT("Endpoint table wasn't built when the entity was indexed", sp->getEndpointTable(&acs)!=nullptr);
+
+        // The table gives the same answers as scanning the endpoints.
+        IndexedEndpointManager<AssertionConsumerService> indexed(*sp, acs), scanned(acs);
+        auto_ptr_XMLCh post(samlconstants::SAML20_BINDING_HTTP_POST);
+        auto_ptr_XMLCh artifact(samlconstants::SAML20_BINDING_HTTP_ARTIFACT);
+        auto_ptr_XMLCh redirect(samlconstants::SAML20_BINDING_HTTP_REDIRECT);
+        TSM_ASSERT_EQUALS("Wrong default endpoint", acs[2], indexed.getDefault());
+        TSM_ASSERT_EQUALS("Wrong default endpoint", scanned.getDefault(), indexed.getDefault());
+        TSM_ASSERT_EQUALS("Wrong endpoint for index", acs[1], indexed.getByIndex(2));
+        TSM_ASSERT_EQUALS("Found endpoint for missing index", (const AssertionConsumerService*)nullptr, indexed.getByIndex(4));
+        TSM_ASSERT_EQUALS("Default endpoint wasn't favored", acs[2], indexed.getByBinding(post.get()));
+        TSM_ASSERT_EQUALS("Default endpoint wasn't favored", scanned.getByBinding(post.get()), indexed.getByBinding(post.get()));
+        TSM_ASSERT_EQUALS("Wrong endpoint for binding", acs[1], indexed.getByBinding(artifact.get()));
+        TSM_ASSERT_EQUALS("Found endpoint for missing binding", (const AssertionConsumerService*)nullptr, indexed.getByBinding(redirect.get()));
+
+        // Without favoring the default, the first endpoint for the binding wins, as it does when scanning.
+        EndpointManager<AssertionConsumerService> unindexed(*sp, acs);
+        TSM_ASSERT_EQUALS("Wrong endpoint for binding", acs[0], unindexed.getByBinding(post.get()));
+        remove(local.c_str());
+    }
+
+    static void pause(int seconds) {
+        auto_ptr<Mutex> mutex(Mutex::create());
+        auto_ptr<CondWait> cond(CondWait::create());
+        Lock lock(mutex.get());
+        for (time_t until = time(nullptr) + seconds; time(nullptr) < until; )
+            cond->timedwait(mutex.get(), 1);
+    }
+
+    void testXMLProviderUnchangedReload() {
+        // A local copy of the metadata, watched for changes.
+        string local("XMLMetadataProviderTest-local.xml"), source = data_path + "saml2/metadata/InCommon-metadata.xml";
+        {
+            ifstream src(source.c_str(), ios::binary);
+            ofstream dest(local.c_str(), ios::binary);
+            dest << src.rdbuf();
+        }
+
+        string config("<MetadataProvider type=\"XML\" path=\"" + local + "\" reloadChanges=\"true\" reloadInterval=\"1\"/>");
+        istringstream in(config);
+        DOMDocument* doc=XMLToolingConfig::getConfig().getParser().parse(in);
+        XercesJanitor<DOMDocument> janitor(doc);
+
+        auto_ptr<MetadataProvider> metadataProvider(
+            SAMLConfig::getConfig().MetadataProviderManager.newPlugin(XML_METADATA_PROVIDER,doc->getDocumentElement())
+            );
+        metadataProvider->init();
+        const EntityDescriptor* descriptor = nullptr;
+        {
+            Locker locker(metadataProvider.get());
+            descriptor = metadataProvider->getEntityDescriptor(MetadataProvider::Criteria(entityID,nullptr,nullptr,false)).first;
+            TSM_ASSERT("Retrieved entity descriptor was null", descriptor!=nullptr);
+        }
+
+        // Rewriting the same document gets it reloaded, but the current instance stays.
+        pause(1);
+        {
+            ifstream src(source.c_str(), ios::binary);
+            ofstream dest(local.c_str(), ios::binary);
+            dest << src.rdbuf();
+        }
+        pause(3);
+        {
+            Locker locker(metadataProvider.get());
+            TSM_ASSERT_EQUALS(
+                "Unchanged reload replaced the instance", descriptor,
+                metadataProvider->getEntityDescriptor(MetadataProvider::Criteria(entityID,nullptr,nullptr,false)).first
+                );
+        }
+
+        // A different one replaces it.
+        {
+            ofstream dest(local.c_str(), ios::binary);
+            dest << "<EntityDescriptor xmlns=\"urn:oasis:names:tc:SAML:2.0:metadata\" entityID=\"https://new.example.org\">"
+                "<IDPSSODescriptor protocolSupportEnumeration=\"urn:oasis:names:tc:SAML:2.0:protocol\">"
+                "<SingleSignOnService Binding=\"urn:oasis:names:tc:SAML:2.0:bindings:HTTP-Redirect\" Location=\"https://new.example.org/sso\"/>"
+                "</IDPSSODescriptor></EntityDescriptor>";
+        }
+        bool found = false;
+        for (int attempt = 0; !found && attempt < 15; ++attempt) {
+            pause(1);
+            Locker locker(metadataProvider.get());
+            found = metadataProvider->getEntityDescriptor(MetadataProvider::Criteria("https://new.example.org",nullptr,nullptr,false)).first!=nullptr;
+        }
+        TSM_ASSERT("Changed metadata was not reloaded", found);
+        metadataProvider.reset();
+        remove(local.c_str());
+    }
+
+    static string hmac(const string& key, const string& data) {
+        string k(key), inner, outer;
+        k.resize(64, '\0');
+        for (string::size_type i = 0; i < k.length(); ++i) {
+            inner += static_cast<char>(k[i] ^ 0x36);
+            outer += static_cast<char>(k[i] ^ 0x5c);
+        }
+        inner += data;
+        outer += SecurityHelper::doHash("SHA1", inner.data(), inner.length(), false);
+        return SecurityHelper::doHash("SHA1", outer.data(), outer.length());
+    }
+
+    void testXMLProviderSnapshot() {
+        // The remote source is unreachable, so startup falls back to the backup or its snapshot.
+        string backing("XMLMetadataProviderTest-backing.xml"), keypath("XMLMetadataProviderTest-snapshot.key");
+        string source = data_path + "saml2/metadata/InCommon-metadata.xml";
+        {
+            ifstream src(source.c_str(), ios::binary);
+            ofstream dest(backing.c_str(), ios::binary);
+            dest << src.rdbuf();
+            ofstream key(keypath.c_str(), ios::binary);
+            key << "not a very secret key";
+        }
+
+        string body(
+            "<EntitiesDescriptor xmlns=\"urn:oasis:names:tc:SAML:2.0:metadata\">"
+            "<EntityDescriptor entityID=\"https://forged.example.org\">"
+            "<IDPSSODescriptor protocolSupportEnumeration=\"urn:oasis:names:tc:SAML:2.0:protocol\">"
+            "<SingleSignOnService Binding=\"urn:oasis:names:tc:SAML:2.0:bindings:HTTP-Redirect\" Location=\"https://forged.example.org/sso\"/>"
+            "</IDPSSODescriptor></EntityDescriptor></EntitiesDescriptor>"
+            );
+        auto_ptr_XMLCh forged("https://forged.example.org");
+
+        string config(
+            "<MetadataProvider type=\"XML\" url=\"http://127.0.0.1:1/metadata.xml\" reloadChanges=\"false\""
+            " backingFilePath=\"" + backing + "\" snapshot=\"true\" snapshotKeyPath=\"" + keypath + "\"/>"
+            );
+        istringstream in(config);
+        DOMDocument* doc=XMLToolingConfig::getConfig().getParser().parse(in);
+        XercesJanitor<DOMDocument> janitor(doc);
+
+        // A snapshot written without the key is ignored in favor of the backup.
+        {
+            ofstream snap((backing + ".snapshot").c_str(), ios::binary);
+            snap << "OpenSAML metadata snapshot 2\n\n" << hmac("some other key", "\n" + body) << '\n' << body;
+        }
+        auto_ptr<MetadataProvider> metadataProvider(
+            SAMLConfig::getConfig().MetadataProviderManager.newPlugin(XML_METADATA_PROVIDER,doc->getDocumentElement())
+            );
+        metadataProvider->init();
+        {
+            Locker locker(metadataProvider.get());
+            TSM_ASSERT("Forged snapshot was loaded",
+                metadataProvider->getEntityDescriptor(MetadataProvider::Criteria(forged.get(),nullptr,nullptr,false)).first==nullptr);
+            TSM_ASSERT("Backup was not loaded",
+                metadataProvider->getEntityDescriptor(MetadataProvider::Criteria(entityID,nullptr,nullptr,false)).first!=nullptr);
+        }
+
+        // One carrying a MAC under the configured key is used in place of the backup.
+        {
+            ofstream snap((backing + ".snapshot").c_str(), ios::binary);
+            snap << "OpenSAML metadata snapshot 2\n\n" << hmac("not a very secret key", "\n" + body) << '\n' << body;
+        }
+        metadataProvider.reset(
+            SAMLConfig::getConfig().MetadataProviderManager.newPlugin(XML_METADATA_PROVIDER,doc->getDocumentElement())
+            );
+        metadataProvider->init();
+        {
+            Locker locker(metadataProvider.get());
+            TSM_ASSERT("Snapshot was not loaded",
+                metadataProvider->getEntityDescriptor(MetadataProvider::Criteria(forged.get(),nullptr,nullptr,false)).first!=nullptr);
+        }
+        metadataProvider.reset();
+
+        remove((backing + ".snapshot").c_str());
+        remove(backing.c_str());
+        remove(keypath.c_str());
+    }
+
     void testXMLWithBlacklists() {
         string config = data_path + "saml2/metadata/XMLWithBlacklists.xml";
         ifstream in(config.c_str());